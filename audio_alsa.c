@@ -0,0 +1,255 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+#include "audio_buffer.h"
+#include "audio_alsa.h"
+
+// The ALSA buffer is the ring: dma_area points at dev->buffer and the
+// hardware pointer is head (capture) or tail (playback) relative to base.
+// Clients move the other end through appl_ptr, which ack() applies to the
+// ring, so no data is ever copied between ALSA and the device.
+
+static const struct snd_pcm_hardware audio_alsa_hw = {
+    .info = SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID |
+            SNDRV_PCM_INFO_INTERLEAVED | SNDRV_PCM_INFO_BLOCK_TRANSFER,
+    .formats = SNDRV_PCM_FMTBIT_S16_LE,
+    .rates = SNDRV_PCM_RATE_44100,
+    .rate_min = SAMPLE_RATE,
+    .rate_max = SAMPLE_RATE,
+    .channels_min = CHANNELS,
+    .channels_max = CHANNELS,
+    .period_bytes_min = 64,
+    .periods_min = 2,
+    .periods_max = 1024,
+};
+
+static int audio_alsa_open(struct snd_pcm_substream *substream)
+{
+    struct audio_buffer_dev *dev = snd_pcm_substream_chip(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    struct audio_alsa *alsa = &dev->alsa;
+    int ret;
+
+    // In-kernel clients attach under the same lock
+    spin_lock_irq(&alsa->lock);
+    if (alsa->substream || audio_buffer_kernel_attached(dev)) {
+        spin_unlock_irq(&alsa->lock);
+        return -EBUSY;
+    }
+    alsa->substream = substream;
+    alsa->capture = substream->stream == SNDRV_PCM_STREAM_CAPTURE;
+    spin_unlock_irq(&alsa->lock);
+
+    ret = audio_buffer_get_ring(dev);
+    if (ret < 0)
+        goto fail_ring;
+
+    // The constraints below are the ring's size, so block SET_SIZE from here
+    // until close, like an mmap. ring_resize checks mmap_count under ring_mutex.
+    mutex_lock(&dev->ring_mutex);
+    atomic_inc(&dev->mmap_count);
+    mutex_unlock(&dev->ring_mutex);
+
+    // The buffer cannot be anything but the whole ring
+    runtime->hw = audio_alsa_hw;
+    runtime->hw.buffer_bytes_max = dev->buffer_size;
+    runtime->hw.period_bytes_max = dev->buffer_size / 2;
+    ret = snd_pcm_hw_constraint_minmax(runtime, SNDRV_PCM_HW_PARAM_BUFFER_BYTES,
+                                       dev->buffer_size, dev->buffer_size);
+    if (ret < 0)
+        goto fail;
+    ret = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+    if (ret < 0)
+        goto fail;
+    return 0;
+
+fail:
+    atomic_dec(&dev->mmap_count);
+    audio_buffer_put_ring(dev);
+fail_ring:
+    spin_lock_irq(&alsa->lock);
+    alsa->substream = NULL;
+    spin_unlock_irq(&alsa->lock);
+    return ret;
+}
+
+static int audio_alsa_close(struct snd_pcm_substream *substream)
+{
+    struct audio_buffer_dev *dev = snd_pcm_substream_chip(substream);
+
+    // Once this returns no writer or reader can be inside a notification
+    spin_lock_irq(&dev->alsa.lock);
+    dev->alsa.substream = NULL;
+    spin_unlock_irq(&dev->alsa.lock);
+    atomic_dec(&dev->mmap_count);
+    audio_buffer_put_ring(dev);
+    return 0;
+}
+
+static int audio_alsa_hw_params(struct snd_pcm_substream *substream,
+                                struct snd_pcm_hw_params *params)
+{
+    struct audio_buffer_dev *dev = snd_pcm_substream_chip(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+
+    // open already stopped the ring from being resized under us
+    runtime->dma_area = dev->buffer;
+    runtime->dma_addr = 0;
+    runtime->dma_bytes = dev->buffer_size;
+    return 0;
+}
+
+static int audio_alsa_hw_free(struct snd_pcm_substream *substream)
+{
+    struct audio_buffer_dev *dev = snd_pcm_substream_chip(substream);
+
+    if (dev->alsa.owned)
+        audio_buffer_alsa_release(dev);
+    substream->runtime->dma_area = NULL;
+    return 0;
+}
+
+// ALSA positions start at 0 on every prepare, so start the ring afresh at a
+// multiple of its size where ALSA's offset 0 and the ring's offset 0 agree.
+// The stream owns its end of the ring from here on.
+static int audio_alsa_prepare(struct snd_pcm_substream *substream)
+{
+    struct audio_buffer_dev *dev = snd_pcm_substream_chip(substream);
+    int ret;
+
+    ret = audio_buffer_alsa_claim(dev, dev->alsa.capture, &dev->alsa.base);
+    if (ret)
+        return ret;
+    dev->alsa.last_appl = 0;
+    return 0;
+}
+
+static int audio_alsa_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+    struct audio_buffer_dev *dev = snd_pcm_substream_chip(substream);
+
+    switch (cmd) {
+    case SNDRV_PCM_TRIGGER_START:
+        // Conflicting owners and modes were refused when prepare claimed the ring
+        WRITE_ONCE(dev->alsa.running, true);
+        return 0;
+    case SNDRV_PCM_TRIGGER_STOP:
+        WRITE_ONCE(dev->alsa.running, false);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+// The "hardware" position is the device side of the ring
+static snd_pcm_uframes_t audio_alsa_pointer(struct snd_pcm_substream *substream)
+{
+    struct audio_buffer_dev *dev = snd_pcm_substream_chip(substream);
+    unsigned long index;
+
+    if (dev->alsa.capture)
+        index = smp_load_acquire(&dev->head);
+    else
+        index = smp_load_acquire(&dev->tail);
+    return bytes_to_frames(substream->runtime, (index - dev->alsa.base) & dev->buffer_mask);
+}
+
+// The client moved appl_ptr: release what it captured or publish what it played
+static int audio_alsa_ack(struct snd_pcm_substream *substream)
+{
+    struct audio_buffer_dev *dev = snd_pcm_substream_chip(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    unsigned long appl = runtime->control->appl_ptr;
+    snd_pcm_sframes_t frames = appl - dev->alsa.last_appl;
+    size_t bytes;
+
+    if (frames < 0)
+        frames += runtime->boundary;
+    dev->alsa.last_appl = appl;
+    if (!frames)
+        return 0;
+    bytes = frames_to_bytes(runtime, frames);
+
+    if (dev->alsa.capture) {
+        audio_buffer_publish_tail(dev, dev->tail + bytes);
+        audio_buffer_wake_writers(dev);
+    } else {
+        audio_buffer_publish_write(dev, dev->head, bytes);
+        audio_buffer_wake_readers(dev);
+    }
+    return 0;
+}
+
+static const struct snd_pcm_ops audio_alsa_ops = {
+    .open = audio_alsa_open,
+    .close = audio_alsa_close,
+    .hw_params = audio_alsa_hw_params,
+    .hw_free = audio_alsa_hw_free,
+    .prepare = audio_alsa_prepare,
+    .trigger = audio_alsa_trigger,
+    .pointer = audio_alsa_pointer,
+    .ack = audio_alsa_ack,
+    .page = snd_pcm_lib_get_vmalloc_page,
+};
+
+// Called by the device when head (capture) or tail (playback) moved, so
+// ALSA can update its hardware pointer and wake its client
+void audio_alsa_notify(struct audio_buffer_dev *dev, bool capture)
+{
+    struct audio_alsa *alsa = &dev->alsa;
+    unsigned long flags;
+
+    if (!READ_ONCE(alsa->running) || alsa->capture != capture)
+        return;
+
+    spin_lock_irqsave(&alsa->lock, flags);
+    if (alsa->substream)
+        snd_pcm_period_elapsed(alsa->substream);
+    spin_unlock_irqrestore(&alsa->lock, flags);
+}
+
+int audio_alsa_register(struct audio_buffer_dev *dev, struct device *parent)
+{
+    struct snd_card *card;
+    struct snd_pcm *pcm;
+    char id[16];
+    int ret;
+
+    snprintf(id, sizeof(id), "AudioBuf%u", dev->minor);
+    ret = snd_card_new(parent, SNDRV_DEFAULT_IDX1, id, THIS_MODULE, 0, &card);
+    if (ret < 0)
+        return ret;
+
+    strscpy(card->driver, "audio_buffer", sizeof(card->driver));
+    snprintf(card->shortname, sizeof(card->shortname), "Audio Buffer %u", dev->minor);
+    snprintf(card->longname, sizeof(card->longname), "Audio Buffer ring /dev/audio_buffer%u",
+             dev->minor);
+
+    ret = snd_pcm_new(card, "Audio Buffer", 0, 1, 1, &pcm);
+    if (ret < 0)
+        goto free_card;
+    pcm->private_data = dev;
+    strscpy(pcm->name, card->shortname, sizeof(pcm->name));
+    snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &audio_alsa_ops);
+    snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &audio_alsa_ops);
+
+    ret = snd_card_register(card);
+    if (ret < 0)
+        goto free_card;
+
+    dev->alsa.card = card;
+    return 0;
+
+free_card:
+    snd_card_free(card);
+    return ret;
+}
+
+void audio_alsa_unregister(struct audio_buffer_dev *dev)
+{
+    if (dev->alsa.card)
+        snd_card_free(dev->alsa.card);
+    dev->alsa.card = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef AUDIO_ALSA_H
+#define AUDIO_ALSA_H
+
+#include <linux/kconfig.h>
+#include <linux/spinlock.h>
+
+struct audio_buffer_dev;
+struct device;
+struct snd_card;
+struct snd_pcm_substream;
+
+// Optional ALSA front end (alsa=1). Each stream device gets a sound card whose
+// PCM buffer is the ring itself: a capture substream consumes what writers
+// queue, a playback substream produces what readers drain. Only one substream
+// is open at a time, and from prepare until hw_free it owns that end of the ring.
+struct audio_alsa {
+    struct snd_card *card;
+    spinlock_t lock;                      // Serializes notifications against close
+    struct snd_pcm_substream *substream;  // Open substream, NULL if none
+    bool capture;                         // substream is the capture direction
+    bool owned;                           // Between prepare and hw_free
+    bool running;                         // Between trigger START and STOP
+    unsigned long base;                   // Ring index of ALSA frame 0
+    unsigned long last_appl;              // appl_ptr already applied to the ring
+};
+
+#if IS_REACHABLE(CONFIG_SND_PCM)
+int audio_alsa_register(struct audio_buffer_dev *dev, struct device *parent);
+void audio_alsa_unregister(struct audio_buffer_dev *dev);
+void audio_alsa_notify(struct audio_buffer_dev *dev, bool capture);
+#else
+static inline int audio_alsa_register(struct audio_buffer_dev *dev, struct device *parent)
+{
+    return -ENODEV;
+}
+static inline void audio_alsa_unregister(struct audio_buffer_dev *dev) {}
+static inline void audio_alsa_notify(struct audio_buffer_dev *dev, bool capture) {}
+#endif
+
+#endif /* AUDIO_ALSA_H */
@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "audio_buffer_ioctl.h"
+
+#define AUDIO_DEVICE "/dev/audio_buffer0"
+#define DEFAULT_SECONDS 2
+#define DEFAULT_MAX_THREADS 8
+#define SCALING_CHUNK 4096
+#define LATENCY_CHUNK 256         // One message: a timestamp plus padding
+#define LATENCY_INTERVAL_NS 1000000  // Writer sends a message every 1 ms
+#define MAX_THREADS 64
+
+// Benchmark suite for the driver. Every run resets the device and then
+// measures one scenario for a fixed time:
+//
+//   throughput  one writer and one reader, per chunk size, blocking and
+//               O_NONBLOCK I/O: MB/s, syscalls/s and EAGAIN/s
+//   scaling     1..N writers against one reader and one writer against
+//               1..N readers, blocking I/O
+//   latency     a paced writer stamps each message with CLOCK_MONOTONIC and
+//               the reader records how long after the write it woke up, with
+//               a blocking read or with poll(): p50/p99/p999 in microseconds
+//
+// Results are printed as CSV (default) or JSON (-j), one record per run, so
+// builds of the module can be compared with a diff or a script. Run it on an
+// idle device: the ring is reset between runs.
+
+enum io_mode { IO_BLOCK, IO_NONBLOCK, IO_POLL };
+static const char * const mode_names[] = { "block", "nonblock", "poll" };
+
+struct result {
+    const char *test;
+    size_t chunk;
+    int writers;
+    int readers;
+    enum io_mode mode;
+    double seconds;
+    double mb_per_s;       // Bytes read
+    double writes_per_s;
+    double reads_per_s;
+    double eagain_per_s;
+    double p50_us;         // Latency runs only
+    double p99_us;
+    double p999_us;
+};
+
+// One thread's counters, padded so threads do not share cache lines
+struct worker {
+    pthread_t tid;
+    size_t chunk;
+    enum io_mode mode;
+    volatile int exited;
+    unsigned long long bytes;
+    unsigned long long calls;
+    unsigned long long eagain;
+    unsigned long long *samples;  // Latency reader: ns per message
+    size_t nr_samples;
+    size_t max_samples;
+} __attribute__((aligned(64)));
+
+static const char *device = AUDIO_DEVICE;
+static volatile int stop;
+static volatile int writers_left;  // Readers drain until every writer is gone
+static int json;
+static int records;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Interrupts a blocked read or write so the thread can see stop
+static void wakeup_handler(int sig)
+{
+    (void)sig;
+}
+
+static int open_device(int flags)
+{
+    int fd = open(device, flags);
+
+    if (fd < 0)
+        fprintf(stderr, "Failed to open %s: %s\n", device, strerror(errno));
+    return fd;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct worker *w = arg;
+    char *buffer;
+    ssize_t ret;
+    int fd;
+
+    fd = open_device(O_WRONLY | (w->mode == IO_NONBLOCK ? O_NONBLOCK : 0));
+    buffer = calloc(1, w->chunk);
+    if (fd < 0 || !buffer)
+        goto out;
+
+    while (!stop) {
+        ret = write(fd, buffer, w->chunk);
+        if (ret > 0) {
+            w->bytes += ret;
+            w->calls++;
+        } else if (ret < 0 && errno == EAGAIN) {
+            w->eagain++;
+        } else if (ret < 0 && errno != EINTR) {
+            perror("Write error");
+            break;
+        }
+    }
+
+out:
+    free(buffer);
+    if (fd >= 0)
+        close(fd);
+    __sync_fetch_and_sub(&writers_left, 1);
+    w->exited = 1;
+    return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct worker *w = arg;
+    char *buffer;
+    ssize_t ret;
+    int fd;
+
+    fd = open_device(O_RDONLY | (w->mode == IO_NONBLOCK ? O_NONBLOCK : 0));
+    buffer = malloc(w->chunk);
+    if (fd < 0 || !buffer)
+        goto out;
+
+    // Keep draining until the writers are out, so none of them is left blocked
+    while (writers_left > 0) {
+        ret = read(fd, buffer, w->chunk);
+        if (ret > 0) {
+            w->bytes += ret;
+            w->calls++;
+        } else if (ret < 0 && errno == EAGAIN) {
+            w->eagain++;
+        } else if (ret < 0 && errno != EINTR) {
+            perror("Read error");
+            break;
+        }
+    }
+
+out:
+    free(buffer);
+    if (fd >= 0)
+        close(fd);
+    w->exited = 1;
+    return NULL;
+}
+
+// Sends a timestamped message every LATENCY_INTERVAL_NS
+static void *latency_writer(void *arg)
+{
+    struct worker *w = arg;
+    char buffer[LATENCY_CHUNK] = { 0 };
+    unsigned long long stamp;
+    struct timespec next;
+    int fd;
+
+    fd = open_device(O_WRONLY);
+    if (fd < 0)
+        goto out;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!stop) {
+        next.tv_nsec += LATENCY_INTERVAL_NS;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        stamp = now_ns();
+        memcpy(buffer, &stamp, sizeof(stamp));
+        if (write(fd, buffer, sizeof(buffer)) == sizeof(buffer)) {
+            w->bytes += sizeof(buffer);
+            w->calls++;
+        }
+    }
+    close(fd);
+
+out:
+    __sync_fetch_and_sub(&writers_left, 1);
+    w->exited = 1;
+    return NULL;
+}
+
+// Wakes on every message, blocking in read() or in poll(), and records how
+// long after its write each one arrived
+static void *latency_reader(void *arg)
+{
+    struct worker *w = arg;
+    char buffer[LATENCY_CHUNK];
+    unsigned long long stamp;
+    size_t period = LATENCY_CHUNK;
+    struct pollfd pfd;
+    ssize_t ret;
+    int fd;
+
+    fd = open_device(O_RDONLY | (w->mode == IO_POLL ? O_NONBLOCK : 0));
+    if (fd < 0)
+        goto out;
+
+    // Only wake once a whole message is there
+    ioctl(fd, AUDIO_BUFFER_IOCTL_SET_PERIOD, &period);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (writers_left > 0) {
+        if (w->mode == IO_POLL && poll(&pfd, 1, -1) < 0)
+            continue;
+        ret = read(fd, buffer, sizeof(buffer));
+        if (ret != sizeof(buffer)) {
+            if (ret < 0 && errno == EAGAIN)
+                w->eagain++;
+            continue;
+        }
+        memcpy(&stamp, buffer, sizeof(stamp));
+        w->bytes += ret;
+        w->calls++;
+        if (w->nr_samples < w->max_samples)
+            w->samples[w->nr_samples++] = now_ns() - stamp;
+    }
+    close(fd);
+
+out:
+    w->exited = 1;
+    return NULL;
+}
+
+static int reset_device(void)
+{
+    int fd = open_device(O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+    ioctl(fd, AUDIO_BUFFER_IOCTL_RESET);
+    close(fd);
+    return 0;
+}
+
+// Signal threads until they have all left their loops; a thread that was
+// between checks when the first signal came is caught by a later one
+static void stop_workers(struct worker *workers, int count)
+{
+    int i, busy;
+
+    stop = 1;
+    do {
+        busy = 0;
+        for (i = 0; i < count; i++) {
+            if (!workers[i].exited) {
+                pthread_kill(workers[i].tid, SIGUSR1);
+                busy = 1;
+            }
+        }
+        if (busy)
+            usleep(1000);
+    } while (busy);
+
+    for (i = 0; i < count; i++)
+        pthread_join(workers[i].tid, NULL);
+}
+
+static void print_result(const struct result *r)
+{
+    if (json) {
+        printf("%s  {\"test\": \"%s\", \"chunk_bytes\": %zu, \"writers\": %d, \"readers\": %d, "
+               "\"mode\": \"%s\", \"seconds\": %.3f, \"mb_per_s\": %.2f, \"writes_per_s\": %.0f, "
+               "\"reads_per_s\": %.0f, \"eagain_per_s\": %.0f, \"p50_us\": %.1f, "
+               "\"p99_us\": %.1f, \"p999_us\": %.1f}",
+               records ? ",\n" : "", r->test, r->chunk, r->writers, r->readers,
+               mode_names[r->mode], r->seconds, r->mb_per_s, r->writes_per_s, r->reads_per_s,
+               r->eagain_per_s, r->p50_us, r->p99_us, r->p999_us);
+    } else {
+        printf("%s,%zu,%d,%d,%s,%.3f,%.2f,%.0f,%.0f,%.0f,%.1f,%.1f,%.1f\n",
+               r->test, r->chunk, r->writers, r->readers, mode_names[r->mode], r->seconds,
+               r->mb_per_s, r->writes_per_s, r->reads_per_s, r->eagain_per_s,
+               r->p50_us, r->p99_us, r->p999_us);
+    }
+    fflush(stdout);
+    records++;
+}
+
+// Run writers and readers for the given time and report their totals
+static int run_io(const char *test, size_t chunk, int writers, int readers,
+                  enum io_mode mode, int seconds)
+{
+    struct worker workers[2 * MAX_THREADS];
+    struct result r = { .test = test, .chunk = chunk, .writers = writers,
+                        .readers = readers, .mode = mode };
+    unsigned long long writes = 0, reads = 0, bytes = 0, eagain = 0;
+    unsigned long long start;
+    int i, count = writers + readers;
+
+    if (reset_device() < 0)
+        return -1;
+    memset(workers, 0, sizeof(workers));
+    stop = 0;
+    writers_left = writers;
+
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        workers[i].chunk = chunk;
+        workers[i].mode = mode;
+        if (pthread_create(&workers[i].tid, NULL,
+                           i < writers ? writer_thread : reader_thread, &workers[i]) != 0) {
+            perror("Failed to create benchmark threads");
+            if (i < writers)
+                __sync_fetch_and_sub(&writers_left, writers - i);
+            stop_workers(workers, i);
+            return -1;
+        }
+    }
+
+    sleep(seconds);
+    stop_workers(workers, count);
+    r.seconds = (now_ns() - start) / 1e9;
+
+    for (i = 0; i < count; i++) {
+        if (i < writers) {
+            writes += workers[i].calls;
+        } else {
+            reads += workers[i].calls;
+            bytes += workers[i].bytes;
+        }
+        eagain += workers[i].eagain;
+    }
+    r.mb_per_s = bytes / r.seconds / (1024.0 * 1024.0);
+    r.writes_per_s = writes / r.seconds;
+    r.reads_per_s = reads / r.seconds;
+    r.eagain_per_s = eagain / r.seconds;
+    print_result(&r);
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const unsigned long long *sorted, size_t count, double p)
+{
+    if (!count)
+        return 0;
+    return sorted[(size_t)(p * (count - 1))] / 1000.0;
+}
+
+static int run_latency(enum io_mode mode, int seconds)
+{
+    struct worker workers[2];
+    struct result r = { .test = "latency", .chunk = LATENCY_CHUNK, .writers = 1,
+                        .readers = 1, .mode = mode };
+    unsigned long long start;
+    struct worker *reader = &workers[1];
+
+    if (reset_device() < 0)
+        return -1;
+    memset(workers, 0, sizeof(workers));
+    stop = 0;
+    writers_left = 1;
+
+    reader->mode = mode;
+    reader->max_samples = (size_t)seconds * (1000000000 / LATENCY_INTERVAL_NS) + 1;
+    reader->samples = calloc(reader->max_samples, sizeof(*reader->samples));
+    if (!reader->samples)
+        return -1;
+
+    start = now_ns();
+    if (pthread_create(&reader->tid, NULL, latency_reader, reader) != 0 ||
+        pthread_create(&workers[0].tid, NULL, latency_writer, &workers[0]) != 0) {
+        perror("Failed to create benchmark threads");
+        return -1;
+    }
+
+    sleep(seconds);
+    stop_workers(workers, 2);
+    r.seconds = (now_ns() - start) / 1e9;
+
+    qsort(reader->samples, reader->nr_samples, sizeof(*reader->samples), compare_u64);
+    r.mb_per_s = reader->bytes / r.seconds / (1024.0 * 1024.0);
+    r.writes_per_s = workers[0].calls / r.seconds;
+    r.reads_per_s = reader->calls / r.seconds;
+    r.eagain_per_s = reader->eagain / r.seconds;
+    r.p50_us = percentile_us(reader->samples, reader->nr_samples, 0.50);
+    r.p99_us = percentile_us(reader->samples, reader->nr_samples, 0.99);
+    r.p999_us = percentile_us(reader->samples, reader->nr_samples, 0.999);
+    print_result(&r);
+    free(reader->samples);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-d device] [-t seconds] [-n max_threads] [-s scenario] [-j]\n"
+            "  scenario: all (default), throughput, scaling or latency\n"
+            "  -j prints JSON instead of CSV\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t chunks[] = { 64, 512, 4096, 32768 };
+    static const enum io_mode io_modes[] = { IO_BLOCK, IO_NONBLOCK };
+    const char *scenario = "all";
+    int max_threads = DEFAULT_MAX_THREADS;
+    int seconds = DEFAULT_SECONDS;
+    struct sigaction sa;
+    int all, ret = 0;
+    size_t i, m;
+    int opt, k;
+
+    while ((opt = getopt(argc, argv, "d:t:n:s:jh")) != -1) {
+        switch (opt) {
+        case 'd': device = optarg; break;
+        case 't': seconds = atoi(optarg); break;
+        case 'n': max_threads = atoi(optarg); break;
+        case 's': scenario = optarg; break;
+        case 'j': json = 1; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    // The seconds per run may still be given as the only argument
+    if (optind < argc)
+        seconds = atoi(argv[optind]);
+    if (seconds <= 0 || max_threads <= 0 || max_threads > MAX_THREADS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // No SA_RESTART: the signal has to interrupt blocked reads and writes
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wakeup_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    all = !strcmp(scenario, "all");
+    if (json)
+        printf("[\n");
+    else
+        printf("test,chunk_bytes,writers,readers,mode,seconds,read_mb_per_s,"
+               "writes_per_s,reads_per_s,eagain_per_s,p50_us,p99_us,p999_us\n");
+
+    if (all || !strcmp(scenario, "throughput"))
+        for (m = 0; m < sizeof(io_modes) / sizeof(io_modes[0]) && !ret; m++)
+            for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]) && !ret; i++)
+                ret = run_io("throughput", chunks[i], 1, 1, io_modes[m], seconds);
+
+    if (all || !strcmp(scenario, "scaling")) {
+        for (k = 1; k <= max_threads && !ret; k *= 2)
+            ret = run_io("scaling", SCALING_CHUNK, k, 1, IO_BLOCK, seconds);
+        for (k = 2; k <= max_threads && !ret; k *= 2)
+            ret = run_io("scaling", SCALING_CHUNK, 1, k, IO_BLOCK, seconds);
+    }
+
+    if (all || !strcmp(scenario, "latency")) {
+        if (!ret)
+            ret = run_latency(IO_BLOCK, seconds);
+        if (!ret)
+            ret = run_latency(IO_POLL, seconds);
+    }
+
+    if (json)
+        printf("\n]\n");
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -5,62 +5,374 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
 #include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/mutex.h>
 #include <linux/export.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/rwsem.h>
+#include <linux/poll.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/jump_label.h>
+#include <linux/moduleparam.h>
 #include "proc_audio.h"
 #include "audio_buffer.h"
+#include "audio_alsa.h"
+#include "audio_stress.h"
+
+#define CREATE_TRACE_POINTS
+#include "audio_buffer_trace.h"
 
 #define DEVICE_NAME "audio_buffer"
 #define CLASS_NAME  "audio"
-#define BUFFER_SIZE (512 * 1024)  // 512 KB buffer
-#define SAMPLE_RATE 44100
-#define CHANNELS    2
-#define FRAME_BYTES 4  // 16-bit stereo = 4 bytes per frame
+#define BUFFER_SIZE (512 * 1024)  // 512 KB default buffer
+#define MAX_BUFFER_SIZE (64 * 1024 * 1024)  // Largest ring SET_SIZE will allocate
+#define MAX_DEVICES 1024  // Minor numbers reserved for stream devices
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Your Name");
 MODULE_DESCRIPTION("Audio Buffer Kernel Module");
 
 
-// Define ioctl commands
-#define AUDIO_BUFFER_IOCTL_MAGIC 'a'
-#define AUDIO_BUFFER_IOCTL_RESET _IO(AUDIO_BUFFER_IOCTL_MAGIC, 0)
-#define AUDIO_BUFFER_IOCTL_GET_SIZE _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 1, size_t)
-#define AUDIO_BUFFER_IOCTL_SET_SIZE _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 2, size_t)
-
-
 static int major_number;
 static struct class *audio_class = NULL;
-struct audio_buffer_dev *audio_device = NULL;
+struct audio_buffer_dev *audio_device = NULL;  // First stream, kept for existing users
 EXPORT_SYMBOL(audio_device);
+
+// Stream devices; entries are only ever added while the module is loaded
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of /dev/audio_bufferN devices to create at load time");
+
+// Debug logging is patched out of the data path unless debug=1
+DEFINE_STATIC_KEY_FALSE(audio_buffer_debug);
+
+static int debug_set(const char *val, const struct kernel_param *kp)
+{
+    bool enable;
+    int ret;
+
+    ret = kstrtobool(val, &enable);
+    if (ret)
+        return ret;
+
+    if (enable)
+        static_branch_enable(&audio_buffer_debug);
+    else
+        static_branch_disable(&audio_buffer_debug);
+    return 0;
+}
+
+static int debug_get(char *buffer, const struct kernel_param *kp)
+{
+    return sysfs_emit(buffer, "%c\n", static_key_enabled(&audio_buffer_debug) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops debug_ops = {
+    .set = debug_set,
+    .get = debug_get,
+};
+module_param_cb(debug, &debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Log opens, closes and resets to the kernel log");
+
+static bool alsa;
+module_param(alsa, bool, 0444);
+MODULE_PARM_DESC(alsa, "Register an ALSA sound card for each stream device");
+
+static unsigned int idle_free_ms = 10000;
+module_param(idle_free_ms, uint, 0644);
+MODULE_PARM_DESC(idle_free_ms, "Free an empty ring this long after its last user goes away (0 = never)");
+
+static struct audio_buffer_dev *audio_devices[MAX_DEVICES];
+static unsigned int device_count;   // Published with release once the device is ready
+static DEFINE_MUTEX(devices_mutex); // Serializes device creation
+
 // function prototypes
 static int device_open(struct inode *, struct file *);
 static int device_release(struct inode *, struct file *);
-static ssize_t device_read(struct file *, char *, size_t, loff_t *);
-static ssize_t device_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t device_write_iter(struct kiocb *, struct iov_iter *);
 void proc_init(void);
 void proc_cleanup(void);
 static long device_ioctl(struct file *filep, unsigned int cmd, unsigned long arg);
+static int device_mmap(struct file *filep, struct vm_area_struct *vma);
+static __poll_t device_poll(struct file *filep, poll_table *wait);
+static int device_fasync(int fd, struct file *filep, int on);
+static void update_wake_marks(struct audio_buffer_dev *dev);
+static void wake_writers(struct audio_buffer_dev *dev);
+static void broadcast_update_tail(struct audio_buffer_dev *dev);
+static void lock_both_sides(struct audio_buffer_dev *dev);
+static void unlock_both_sides(struct audio_buffer_dev *dev);
 
 static struct file_operations fops = {
     .open = device_open,
     .release = device_release,
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
+    // splice/sendfile hand pipe pages straight to write_iter as a bvec
+    // iterator (and fill pipe pages from read_iter), so file data reaches the
+    // ring without a userspace bounce; the wrap split is in ring_copy_*_iter
+    .splice_write = iter_file_splice_write,
+    .splice_read = copy_splice_read,
     .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
+    .poll = device_poll,
+    .fasync = device_fasync,
 };
 
+unsigned int audio_buffer_device_count(void)
+{
+    return smp_load_acquire(&device_count);
+}
+EXPORT_SYMBOL_GPL(audio_buffer_device_count);
+
+struct audio_buffer_dev *audio_buffer_get_device(unsigned int minor)
+{
+    if (minor >= audio_buffer_device_count())
+        return NULL;
+    return audio_devices[minor];
+}
+EXPORT_SYMBOL_GPL(audio_buffer_get_device);
+
+// Free the ring of a device nobody has used for idle_free_ms. Audio still
+// queued for a later reader, or a clock still draining it, keeps it allocated;
+// the next put tries again.
+static void ring_idle_work(struct work_struct *work)
+{
+    struct audio_buffer_dev *dev = container_of(to_delayed_work(work),
+                                                struct audio_buffer_dev, idle_work);
+    unsigned char *buffer = NULL;
+
+    mutex_lock(&dev->ring_mutex);
+    if (!dev->ring_users && dev->buffer) {
+        lock_both_sides(dev);
+        if (!audio_buffer_used(dev) && !READ_ONCE(dev->clock.running)) {
+            buffer = dev->buffer;
+            WRITE_ONCE(dev->buffer, NULL);
+        }
+        unlock_both_sides(dev);
+    }
+    mutex_unlock(&dev->ring_mutex);
+
+    if (buffer)
+        audio_buffer_dbg("Device %u ring freed while idle\n", dev->minor);
+    vfree(buffer);
+}
+
+int audio_buffer_get_ring(struct audio_buffer_dev *dev)
+{
+    unsigned char *buffer;
+
+    mutex_lock(&dev->ring_mutex);
+    if (!dev->buffer) {
+        // vmalloc_user pages can be handed to userspace one at a time by the fault handler
+        buffer = vmalloc_user(dev->buffer_size);
+        if (!buffer) {
+            mutex_unlock(&dev->ring_mutex);
+            printk(KERN_ERR "Audio Buffer: Failed to allocate buffer memory\n");
+            return -ENOMEM;
+        }
+        WRITE_ONCE(dev->buffer, buffer);
+    }
+    dev->ring_users++;
+    mutex_unlock(&dev->ring_mutex);
+    return 0;
+}
+
+void audio_buffer_put_ring(struct audio_buffer_dev *dev)
+{
+    unsigned int delay = READ_ONCE(idle_free_ms);
+
+    mutex_lock(&dev->ring_mutex);
+    if (!--dev->ring_users && delay)
+        mod_delayed_work(system_wq, &dev->idle_work, msecs_to_jiffies(delay));
+    mutex_unlock(&dev->ring_mutex);
+}
+
+// Allocate one stream with its own locks and wait queues and create its node
+static struct audio_buffer_dev *audio_buffer_create_device(unsigned int minor)
+{
+    struct audio_buffer_dev *dev;
+    struct device *node;
+    int result;
+    int cpu;
+
+    // allocate the device structure
+    dev = kzalloc(sizeof(struct audio_buffer_dev), GFP_KERNEL);
+    if (!dev) {
+        printk(KERN_ALERT "Audio Buffer: Failed to allocate device structure\n");
+        return ERR_PTR(-ENOMEM);
+    }
+
+    // initialize the device structure; the ring itself is allocated by the first user
+    dev->ctrl = (struct audio_buffer_mmap_ctrl *)get_zeroed_page(GFP_KERNEL);
+    if (!dev->ctrl) {
+        printk(KERN_ALERT "Audio Buffer: Failed to allocate control page\n");
+        result = -ENOMEM;
+        goto free_dev;
+    }
+
+    dev->stats = alloc_percpu(struct audio_buffer_stats);
+    if (!dev->stats) {
+        printk(KERN_ALERT "Audio Buffer: Failed to allocate statistics\n");
+        result = -ENOMEM;
+        goto free_ctrl;
+    }
+    for_each_possible_cpu(cpu)
+        seqcount_init(&per_cpu_ptr(dev->stats, cpu)->seq);
+
+    dev->minor = minor;
+    dev->buffer_size = BUFFER_SIZE;
+    dev->buffer_mask = BUFFER_SIZE - 1;
+    dev->ctrl->buffer_size = BUFFER_SIZE;
+    dev->head = 0;
+    dev->tail = 0;
+    dev->is_playing = false;
+    atomic_set(&dev->mmap_count, 0);
+
+    init_waitqueue_head(&dev->read_queue);
+    init_waitqueue_head(&dev->write_queue);
+    init_waitqueue_head(&dev->commit_queue);
+    INIT_LIST_HEAD(&dev->clients);
+    spin_lock_init(&dev->clients_lock);
+    spin_lock_init(&dev->alsa.lock);  // Taken by audio_buffer_attach even without a card
+    dev->read_wake = 1;
+    dev->write_wake = 1;
+    init_rwsem(&dev->config_rwsem);
+    seqcount_init(&dev->pos_seq);
+    audio_clock_init(dev);
+    audio_mixer_init(dev);
+    audio_jitter_init(dev);
+    mutex_init(&dev->write_mutex);
+    mutex_init(&dev->read_mutex);
+    mutex_init(&dev->ring_mutex);
+    INIT_DELAYED_WORK(&dev->idle_work, ring_idle_work);
+
+    // initialize the character device
+    cdev_init(&dev->cdev, &fops);
+    dev->cdev.owner = THIS_MODULE;
+
+    // Add the device to the system
+    result = cdev_add(&dev->cdev, MKDEV(major_number, minor), 1);
+    if (result < 0) {
+        printk(KERN_ALERT "Audio Buffer: Failed to add device to system\n");
+        goto free_stats;
+    }
+
+    // Create the device node in /dev
+    node = device_create(audio_class, NULL, MKDEV(major_number, minor), dev, DEVICE_NAME "%u", minor);
+    if (IS_ERR(node)) {
+        printk(KERN_ALERT "Audio Buffer: Failed to create device node\n");
+        result = PTR_ERR(node);
+        goto del_cdev;
+    }
+
+    // The sound card is optional; the stream works without it
+    if (alsa && audio_alsa_register(dev, node))
+        printk(KERN_WARNING "Audio Buffer: No ALSA card for device %u\n", minor);
+
+    return dev;
+
+del_cdev:
+    cdev_del(&dev->cdev);
+free_stats:
+    free_percpu(dev->stats);
+free_ctrl:
+    free_page((unsigned long)dev->ctrl);
+free_dev:
+    kfree(dev);
+    return ERR_PTR(result);
+}
+
+static void audio_buffer_destroy_device(struct audio_buffer_dev *dev)
+{
+    audio_alsa_unregister(dev);
+    audio_clock_pause(dev);
+    device_destroy(audio_class, MKDEV(major_number, dev->minor));
+    cdev_del(&dev->cdev);
+    audio_mixer_cleanup(dev);
+    cancel_delayed_work_sync(&dev->idle_work);
+
+    free_percpu(dev->stats);
+    free_page((unsigned long)dev->ctrl);
+    vfree(dev->buffer);
+    kfree(dev);
+}
+
+// Grow the set of stream devices to count
+static int audio_buffer_add_devices(unsigned int count)
+{
+    struct audio_buffer_dev *dev;
+    unsigned int minor;
+    int result = 0;
+
+    if (count > MAX_DEVICES)
+        return -EINVAL;
+
+    mutex_lock(&devices_mutex);
+    for (minor = device_count; minor < count; minor++) {
+        dev = audio_buffer_create_device(minor);
+        if (IS_ERR(dev)) {
+            result = PTR_ERR(dev);
+            break;
+        }
+        audio_devices[minor] = dev;
+        smp_store_release(&device_count, minor + 1);
+    }
+    mutex_unlock(&devices_mutex);
+
+    return result;
+}
+
+// /sys/class/audio/nr_devices: read the stream count, write a larger one to add streams
+static ssize_t nr_devices_show(const struct class *class, const struct class_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%u\n", audio_buffer_device_count());
+}
+
+static ssize_t nr_devices_store(const struct class *class, const struct class_attribute *attr,
+                                const char *buf, size_t count)
+{
+    unsigned int new_count;
+    int result;
+
+    result = kstrtouint(buf, 0, &new_count);
+    if (result)
+        return result;
+
+    // Streams may be open, so existing devices are never removed here
+    if (new_count < audio_buffer_device_count())
+        return -EINVAL;
+
+    result = audio_buffer_add_devices(new_count);
+    if (result < 0)
+        return result;
+
+    printk(KERN_INFO "Audio Buffer: %u stream devices available\n", new_count);
+    return count;
+}
+static CLASS_ATTR_RW(nr_devices);
+
 static int __init audio_buffer_init(void)
 {
     dev_t dev = 0;
+    unsigned int minor;
     int result;
     
     printk(KERN_INFO "Audio Buffer: Initializing the module\n");
+
+    if (nr_devices == 0 || nr_devices > MAX_DEVICES) {
+        printk(KERN_ALERT "Audio Buffer: nr_devices must be between 1 and %d\n", MAX_DEVICES);
+        return -EINVAL;
+    }
     
-    // allocate device numbers
-    result = alloc_chrdev_region(&dev, 0, 1, DEVICE_NAME);
+    // allocate device numbers for every stream that may ever be added
+    result = alloc_chrdev_region(&dev, 0, MAX_DEVICES, DEVICE_NAME);
     if (result < 0) {
         printk(KERN_ALERT "Audio Buffer: Failed to allocate device numbers\n");
         return result;
@@ -70,311 +382,1864 @@ static int __init audio_buffer_init(void)
     // create device class
     audio_class = class_create(CLASS_NAME);
     if (IS_ERR(audio_class)) {
-        unregister_chrdev_region(dev, 1);
+        unregister_chrdev_region(dev, MAX_DEVICES);
         printk(KERN_ALERT "Audio Buffer: Failed to create device class\n");
         return PTR_ERR(audio_class);
     }
-    
-    // allocate the device structure
-    audio_device = kmalloc(sizeof(struct audio_buffer_dev), GFP_KERNEL);
-    if (!audio_device) {
-        class_destroy(audio_class);
-        unregister_chrdev_region(dev, 1);
-        printk(KERN_ALERT "Audio Buffer: Failed to allocate device structure\n");
-        return -ENOMEM;
-    }
-    
-    // initialize the device structure
-    audio_device->buffer = kmalloc(BUFFER_SIZE, GFP_KERNEL);
-    if (!audio_device->buffer) {
-        kfree(audio_device);
-        class_destroy(audio_class);
-        unregister_chrdev_region(dev, 1);
-        printk(KERN_ALERT "Audio Buffer: Failed to allocate buffer memory\n");
-        return -ENOMEM;
-    }
-    
-    audio_device->buffer_size = BUFFER_SIZE;
-    audio_device->read_pos = 0;
-    audio_device->write_pos = 0;
-    audio_device->data_size = 0;
-    audio_device->is_playing = false;
-    
-    init_waitqueue_head(&audio_device->read_queue);
-    init_waitqueue_head(&audio_device->write_queue);
-    mutex_init(&audio_device->buffer_mutex);
-    
-    // initialize the character device
-    cdev_init(&audio_device->cdev, &fops);
-    audio_device->cdev.owner = THIS_MODULE;
-    
-    // Add the device to the system
-    result = cdev_add(&audio_device->cdev, dev, 1);
+
+    result = class_create_file(audio_class, &class_attr_nr_devices);
     if (result < 0) {
-        kfree(audio_device->buffer);
-        kfree(audio_device);
         class_destroy(audio_class);
-        unregister_chrdev_region(dev, 1);
-        printk(KERN_ALERT "Audio Buffer: Failed to add device to system\n");
+        unregister_chrdev_region(dev, MAX_DEVICES);
+        printk(KERN_ALERT "Audio Buffer: Failed to create nr_devices attribute\n");
         return result;
     }
     
-    // Create the device node in /dev
-    if (IS_ERR(device_create(audio_class, NULL, dev, NULL, DEVICE_NAME))) {
-        cdev_del(&audio_device->cdev);
-        kfree(audio_device->buffer);
-        kfree(audio_device);
+    // Create the initial streams
+    result = audio_buffer_add_devices(nr_devices);
+    if (result < 0) {
+        for (minor = 0; minor < device_count; minor++)
+            audio_buffer_destroy_device(audio_devices[minor]);
+        class_remove_file(audio_class, &class_attr_nr_devices);
         class_destroy(audio_class);
-        unregister_chrdev_region(dev, 1);
-        printk(KERN_ALERT "Audio Buffer: Failed to create device node\n");
-        return PTR_ERR(audio_class);
+        unregister_chrdev_region(dev, MAX_DEVICES);
+        return result;
     }
+    audio_device = audio_devices[0];
 
     proc_init();  // Initialize the proc file
+    audio_stress_init();
     
-    printk(KERN_INFO "Audio Buffer: Device initialized successfully with major number %d\n", major_number);
+    printk(KERN_INFO "Audio Buffer: %u devices initialized successfully with major number %d\n",
+           nr_devices, major_number);
     return 0;
 }
 
 static void __exit audio_buffer_exit(void)
 {
+    unsigned int minor;
 
+    audio_stress_cleanup();
     proc_cleanup();
     
-    device_destroy(audio_class, MKDEV(major_number, 0));
-    cdev_del(&audio_device->cdev);
-    
-    kfree(audio_device->buffer);
-    kfree(audio_device);
+    class_remove_file(audio_class, &class_attr_nr_devices);
+    for (minor = 0; minor < device_count; minor++)
+        audio_buffer_destroy_device(audio_devices[minor]);
     
     class_destroy(audio_class);
-    unregister_chrdev_region(MKDEV(major_number, 0), 1);
+    unregister_chrdev_region(MKDEV(major_number, 0), MAX_DEVICES);
     
     printk(KERN_INFO "Audio Buffer: Module unloaded\n");
 }
 
 static int device_open(struct inode *inodep, struct file *filep)
 {
-    printk(KERN_INFO "Audio Buffer: Device opened\n");
+    struct audio_buffer_dev *dev = container_of(inodep->i_cdev, struct audio_buffer_dev, cdev);
+    struct audio_buffer_client *client;
+    int ret;
+
+    // Per-open state; the default period of one byte wakes on any change
+    client = kzalloc(sizeof(*client), GFP_KERNEL);
+    if (!client)
+        return -ENOMEM;
+    ret = audio_buffer_get_ring(dev);
+    if (ret) {
+        kfree(client);
+        return ret;
+    }
+    client->dev = dev;
+    client->mode = filep->f_mode;
+    client->period = 1;
+    client->gain = AUDIO_BUFFER_GAIN_UNITY;
+
+    // A broadcast reader starts with the data that is still queued
+    spin_lock(&dev->clients_lock);
+    if (dev->clients_blocked) {
+        spin_unlock(&dev->clients_lock);
+        audio_buffer_put_ring(dev);
+        kfree(client);
+        return -EBUSY;
+    }
+    client->cursor = dev->tail;
+    list_add(&client->node, &dev->clients);
+    if (dev->flags & AUDIO_BUFFER_FLAG_BROADCAST)
+        broadcast_update_tail(dev);
+    spin_unlock(&dev->clients_lock);
+    update_wake_marks(dev);
+
+    filep->private_data = client;
+    // read_iter/write_iter honour IOCB_NOWAIT, so io_uring can complete inline
+    filep->f_mode |= FMODE_NOWAIT;
+    audio_buffer_dbg("Device %u opened\n", dev->minor);
     return 0;
 }
 
 static int device_release(struct inode *inodep, struct file *filep)
 {
-    printk(KERN_INFO "Audio Buffer: Device closed\n");
+    struct audio_buffer_client *client = filep->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+
+    device_fasync(-1, filep, 0);
+
+    spin_lock(&dev->clients_lock);
+    list_del(&client->node);
+    // The slowest broadcast reader may just have left
+    if (dev->flags & AUDIO_BUFFER_FLAG_BROADCAST)
+        broadcast_update_tail(dev);
+    spin_unlock(&dev->clients_lock);
+    update_wake_marks(dev);
+    audio_mixer_detach(dev, client);
+    kfree(client->conv_buf);
+    kfree(client);
+    wake_writers(dev);
+    audio_buffer_put_ring(dev);
+
+    audio_buffer_dbg("Device %u closed\n", dev->minor);
     return 0;
 }
 
-static ssize_t device_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
+// Copy len bytes out of the ring starting at index, splitting at the wrap
+// point. Returns how many bytes were copied before any fault.
+static size_t ring_copy_to_iter(struct audio_buffer_dev *dev, struct iov_iter *to,
+                                unsigned long index, size_t len)
 {
-    size_t bytes_to_copy;
-    int ret;
-    
-    // Lock the buffer
-    if (mutex_lock_interruptible(&audio_device->buffer_mutex))
-        return -ERESTARTSYS;
-    
-    // Wait for data if empty
-    while (audio_device->data_size == 0) {
-        mutex_unlock(&audio_device->buffer_mutex);
-        
-        if (filep->f_flags & O_NONBLOCK)
-            return -EAGAIN;
-        
-        if (wait_event_interruptible(audio_device->read_queue, audio_device->data_size > 0))
-            return -ERESTARTSYS;
-        
-        if (mutex_lock_interruptible(&audio_device->buffer_mutex))
-            return -ERESTARTSYS;
-    }
-    
-    // Calculate how many bytes to copy
-    bytes_to_copy = min(len, audio_device->data_size);
-    
-    // Handle buffer wraparound
-    if (audio_device->read_pos + bytes_to_copy > audio_device->buffer_size) {
-        size_t first_chunk = audio_device->buffer_size - audio_device->read_pos;
-        
-        // Copy the first chunk (up to the end of the buffer)
-        ret = copy_to_user(buffer, audio_device->buffer + audio_device->read_pos, first_chunk);
-        if (ret) {
-            mutex_unlock(&audio_device->buffer_mutex);
-            return -EFAULT;
-        }
-        
-        // Copy the second chunk (from the beginning of the buffer)
-        ret = copy_to_user(buffer + first_chunk, audio_device->buffer, bytes_to_copy - first_chunk);
-        if (ret) {
-            mutex_unlock(&audio_device->buffer_mutex);
-            return -EFAULT;
-        }
-        
-        audio_device->read_pos = bytes_to_copy - first_chunk;
-    } else {
-        // Simple case - no wraparound
-        ret = copy_to_user(buffer, audio_device->buffer + audio_device->read_pos, bytes_to_copy);
-        if (ret) {
-            mutex_unlock(&audio_device->buffer_mutex);
-            return -EFAULT;
-        }
-        
-        audio_device->read_pos += bytes_to_copy;
-        if (audio_device->read_pos == audio_device->buffer_size)
-            audio_device->read_pos = 0;
+    struct audio_ring_span span = audio_ring_span(dev->buffer_size, index, len);
+    size_t copied;
+
+    // Copy the first chunk (up to the end of the buffer)
+    copied = copy_to_iter(dev->buffer + span.pos, span.first, to);
+
+    // Copy the second chunk (from the beginning of the buffer)
+    if (copied == span.first && span.second)
+        copied += copy_to_iter(dev->buffer, span.second, to);
+
+    return copied;
+}
+
+// Convert frames starting at index into dst. A frame split by the wrap point
+// (a raw reader can leave tail unaligned) is gathered into a local copy first.
+static void ring_convert(struct audio_buffer_dev *dev, const struct audio_convert *conv,
+                         unsigned long index, unsigned char *dst, size_t frames)
+{
+    struct audio_ring_span span = audio_ring_span(dev->buffer_size, index, frames * FRAME_BYTES);
+    size_t first = span.first / FRAME_BYTES;
+    size_t skip = 0;
+    unsigned char frame[FRAME_BYTES];
+
+    audio_convert_frames(conv, dst, dev->buffer + span.pos, first);
+    dst += first * conv->frame_bytes;
+    if (span.first % FRAME_BYTES) {
+        audio_ring_read(dev->buffer, dev->buffer_size, index + first * FRAME_BYTES,
+                        frame, FRAME_BYTES);
+        audio_convert_frames(conv, dst, frame, 1);
+        dst += conv->frame_bytes;
+        skip = FRAME_BYTES - span.first % FRAME_BYTES;
+        first++;
     }
-    
-    // Update the data size
-    audio_device->data_size -= bytes_to_copy;
-    
-    // Wake up any writers waiting for space
-    mutex_unlock(&audio_device->buffer_mutex);
-    wake_up_interruptible(&audio_device->write_queue);
-    
-    printk(KERN_INFO "Audio Buffer: Read %zu bytes\n", bytes_to_copy);
-    return bytes_to_copy;
+    audio_convert_frames(conv, dst, dev->buffer + skip, frames - first);
 }
 
-static ssize_t device_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
+// Copy up to len bytes starting at index to a reader, in its read format.
+// Returns the ring bytes consumed; a converting reader only ever takes whole
+// frames, so a fault part way through a frame gives that frame back. Called
+// with read_mutex held, which also guards client->conv and its bounce buffer.
+static size_t client_copy_to_iter(struct audio_buffer_client *client, struct iov_iter *to,
+                                  unsigned long index, size_t len)
 {
-    size_t bytes_to_copy;
-    size_t space_available;
-    int ret;
-    
-    // Lock the buffer
-    if (mutex_lock_interruptible(&audio_device->buffer_mutex))
-        return -ERESTARTSYS;
-    
-    // Calculate available space
-    space_available = audio_device->buffer_size - audio_device->data_size;
-    
-    // Wait if the buffer is full
-    while (space_available == 0) {
-        mutex_unlock(&audio_device->buffer_mutex);
-        
-        if (filep->f_flags & O_NONBLOCK)
-            return -EAGAIN;
-        
-        if (wait_event_interruptible(audio_device->write_queue, 
-                                    (audio_device->buffer_size - audio_device->data_size) > 0))
-            return -ERESTARTSYS;
-        
-        if (mutex_lock_interruptible(&audio_device->buffer_mutex))
-            return -ERESTARTSYS;
-        
-        space_available = audio_device->buffer_size - audio_device->data_size;
+    struct audio_buffer_dev *dev = client->dev;
+    const struct audio_convert *conv = &client->conv;
+    size_t frames, chunk, out, copied;
+    size_t done = 0;
+
+    if (!conv->frame_bytes)
+        return ring_copy_to_iter(dev, to, index, len);
+    // A reader that asked for the stream's own format skips the bounce
+    if (conv->copy) {
+        copied = ring_copy_to_iter(dev, to, index,
+                                   audio_ring_frames(min(len, iov_iter_count(to)), FRAME_BYTES));
+        iov_iter_revert(to, copied % FRAME_BYTES);
+        return audio_ring_frames(copied, FRAME_BYTES);
     }
-    
-    // Calculate how many bytes to copy
-    bytes_to_copy = min(len, space_available);
-    
-    // Handle buffer wraparound
-    if (audio_device->write_pos + bytes_to_copy > audio_device->buffer_size) {
-        size_t first_chunk = audio_device->buffer_size - audio_device->write_pos;
-        
-        // Copy the first chunk (up to the end of the buffer)
-        ret = copy_from_user(audio_device->buffer + audio_device->write_pos, buffer, first_chunk);
-        if (ret) {
-            mutex_unlock(&audio_device->buffer_mutex);
-            return -EFAULT;
-        }
-        
-        // Copy the second chunk (from the beginning of the buffer)
-        ret = copy_from_user(audio_device->buffer, buffer + first_chunk, bytes_to_copy - first_chunk);
-        if (ret) {
-            mutex_unlock(&audio_device->buffer_mutex);
-            return -EFAULT;
-        }
-        
-        audio_device->write_pos = bytes_to_copy - first_chunk;
-    } else {
-        // Simple case - no wraparound
-        ret = copy_from_user(audio_device->buffer + audio_device->write_pos, buffer, bytes_to_copy);
-        if (ret) {
-            mutex_unlock(&audio_device->buffer_mutex);
-            return -EFAULT;
+
+    frames = min(len / FRAME_BYTES, iov_iter_count(to) / conv->frame_bytes);
+    while (done < frames) {
+        chunk = min_t(size_t, frames - done, AUDIO_BUFFER_CONVERT_BOUNCE / conv->frame_bytes);
+        ring_convert(dev, conv, index + done * FRAME_BYTES, client->conv_buf, chunk);
+        out = chunk * conv->frame_bytes;
+        copied = copy_to_iter(client->conv_buf, out, to);
+        if (copied < out) {
+            iov_iter_revert(to, copied % conv->frame_bytes);
+            done += copied / conv->frame_bytes;
+            break;
         }
-        
-        audio_device->write_pos += bytes_to_copy;
-        if (audio_device->write_pos == audio_device->buffer_size)
-            audio_device->write_pos = 0;
+        done += chunk;
     }
-    
-    // Update the data size and set playing flag
-    audio_device->data_size += bytes_to_copy;
-    audio_device->is_playing = true;
-    
-    // Wake up any readers waiting for data
-    mutex_unlock(&audio_device->buffer_mutex);
-    wake_up_interruptible(&audio_device->read_queue);
-    
-    printk(KERN_INFO "Audio Buffer: Wrote %zu bytes\n", bytes_to_copy);
-    return bytes_to_copy;
+    return done * FRAME_BYTES;
 }
 
-static long device_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+// Bytes a reader receives for ring bytes it consumed, with read_mutex held
+static size_t client_out_bytes(struct audio_buffer_client *client, size_t bytes)
 {
-    size_t new_size;
-    void *new_buffer;
-    int ret = 0;
+    if (!client->conv.frame_bytes)
+        return bytes;
+    return bytes / FRAME_BYTES * client->conv.frame_bytes;
+}
 
-    switch(cmd){
-        case AUDIO_BUFFER_IOCTL_RESET:
-            //Resets the audio buffer
-            mutex_lock(&audio_device->buffer_mutex);
-            audio_device->read_pos=0;
-            audio_device->write_pos=0;
-            audio_device->data_size=0;
-            audio_device->is_playing=false;
-            mutex_unlock(&audio_device->buffer_mutex);
-            printk(KERN_INFO "Audio Buffer: Buffer reset\n");
-            break;
-        case AUDIO_BUFFER_IOCTL_GET_SIZE:
-            ret = copy_to_user((size_t __user *)arg, &audio_device->buffer_size, sizeof(size_t));
-            if(ret){
-                printk(KERN_ERR "Audio Buffer: failed to get buffer size");
-                return -EFAULT;
-            }
-            break;
-        case AUDIO_BUFFER_IOCTL_SET_SIZE:
-            //coppies the new buffer size to the user
-            ret = copy_to_user(&new_size, (size_t __user *)arg, sizeof(size_t));
-            if(ret){
-                printk(KERN_ERR "Audio Buffer: failed to set buffer size");
-                return -EFAULT;
-            }
-            //checks if its above the max buffer size
-            if(new_size == 0 || new_size > BUFFER_SIZE){
-                printk(KERN_ERR "Audio Buffer: new size cannot be 0 or greater than the buffer size.");
-                return -EINVAL;
-            }
+// Ring bytes whose converted form fits in what is left of a reader's iterator
+static size_t client_iter_bytes(struct audio_buffer_client *client, struct iov_iter *to)
+{
+    u32 frame_bytes = READ_ONCE(client->conv.frame_bytes);
 
-            new_buffer = kmalloc(new_size, GFP_KERNEL);
-            if(!new_buffer)
-            {
-                printk(KERN_ERR "Audio Buffer: Failed to allocate new buffer");
-                return -ENOMEM;
-            }
+    if (!frame_bytes)
+        return iov_iter_count(to);
+    return iov_iter_count(to) / frame_bytes * FRAME_BYTES;
+}
 
-            //Sets the buffer size and resets the audio_device
-            mutex_lock(&audio_device->buffer_mutex);
-            kfree(audio_device->buffer);
-            audio_device->buffer = new_buffer;
-            audio_device->buffer_size = new_size;
-            audio_device->read_pos = 0;
-            audio_device->write_pos = 0;
-            audio_device->data_size = 0;
-            audio_device->is_playing = false;
-            mutex_unlock(&audio_device->buffer_mutex);
-            printk(KERN_INFO "Audio Buffer: new size set to %zu\n", new_size);
-        
-            break;
-        default:
-            return -ENOTTY;
-        
+// Copy len bytes into the ring starting at index, splitting at the wrap
+// point. Returns how many bytes were copied before any fault.
+static size_t ring_copy_from_iter(struct audio_buffer_dev *dev, unsigned long index,
+                                  struct iov_iter *from, size_t len)
+{
+    struct audio_ring_span span = audio_ring_span(dev->buffer_size, index, len);
+    size_t copied;
+
+    // Copy the first chunk (up to the end of the buffer)
+    copied = copy_from_iter(dev->buffer + span.pos, span.first, from);
+
+    // Copy the second chunk (from the beginning of the buffer)
+    if (copied == span.first && span.second)
+        copied += copy_from_iter(dev->buffer, span.second, from);
+
+    return copied;
+}
+
+// Whole frames that can still be reserved by multi-producer writers
+static size_t mpsc_space(struct audio_buffer_dev *dev)
+{
+    unsigned long tail = smp_load_acquire(&dev->tail);
+
+    return audio_ring_frames(audio_ring_space(dev->buffer_size, READ_ONCE(dev->reserve), tail),
+                             FRAME_BYTES);
+}
+
+// Space writers can use right now, in whole frames for MPSC writers
+static size_t write_space(struct audio_buffer_dev *dev)
+{
+    unsigned int flags = READ_ONCE(dev->flags);
+
+    if (flags & AUDIO_BUFFER_FLAG_MPSC)
+        return mpsc_space(dev);
+    // Overwrite mode makes room on demand, so the whole ring is always writable
+    if (flags & AUDIO_BUFFER_FLAG_OVERWRITE)
+        return dev->buffer_size;
+    // So does broadcast mode when only lossy readers are left
+    if ((flags & AUDIO_BUFFER_FLAG_BROADCAST) && !READ_ONCE(dev->blocking_readers))
+        return dev->buffer_size;
+    return dev->buffer_size - audio_buffer_used(dev);
+}
+
+// Overwrite mode: drop the oldest whole frames until want bytes are free and
+// return the space now available. Called with write_mutex held; read_mutex is
+// taken so no reader is copying out of the frames being discarded. Unless wait
+// is set, a reader that holds it is left alone and only the current space is
+// returned, so the writer does not sleep behind its copy.
+static size_t overwrite_oldest(struct audio_buffer_dev *dev, size_t want, bool wait)
+{
+    size_t space;
+    size_t drop;
+    u64 frames;
+    unsigned long tail;
+
+    if (wait)
+        mutex_lock(&dev->read_mutex);
+    else if (!mutex_trylock(&dev->read_mutex))
+        return dev->buffer_size - audio_buffer_used(dev);
+    space = dev->buffer_size - audio_buffer_used(dev);
+    if (space >= want) {
+        mutex_unlock(&dev->read_mutex);
+        return space;
     }
-    return 0;
+    drop = min(roundup(want - space, FRAME_BYTES), audio_buffer_used(dev));
+    frames = DIV_ROUND_UP(drop, FRAME_BYTES);
+    tail = dev->tail;
+    audio_buffer_publish_tail(dev, tail + drop);
+    WRITE_ONCE(dev->dropped_frames, dev->dropped_frames + frames);
+    mutex_unlock(&dev->read_mutex);
+
+    trace_audio_buffer_overrun(dev->minor, dev->head, tail + drop);
+    audio_stats_add(dev->stats, AUDIO_STATS_WRITE, AUDIO_STAT_XRUNS, frames);
+    return space + drop;
 }
 
+// Broadcast mode: move tail up to the slowest reader that is not lossy and
+// recount those readers. Called with clients_lock held.
+static void broadcast_update_tail(struct audio_buffer_dev *dev)
+{
+    struct audio_buffer_client *client;
+    size_t behind = SIZE_MAX;
+    unsigned int readers = 0;
+
+    list_for_each_entry(client, &dev->clients, node) {
+        if (!(client->mode & FMODE_READ) || (client->reader_flags & AUDIO_BUFFER_READER_LOSSY))
+            continue;
+        readers++;
+        behind = min_t(size_t, behind, client->cursor - dev->tail);
+    }
+    WRITE_ONCE(dev->blocking_readers, readers);
+    if (readers && behind)
+        audio_buffer_publish_tail(dev, dev->tail + behind);
+}
+
+// Start every reader at index after the ring was emptied or broadcast mode
+// was switched on. Called with both sides locked.
+static void broadcast_reset_cursors(struct audio_buffer_dev *dev, unsigned long index)
+{
+    struct audio_buffer_client *client;
+
+    spin_lock(&dev->clients_lock);
+    list_for_each_entry(client, &dev->clients, node)
+        WRITE_ONCE(client->cursor, index);
+    broadcast_update_tail(dev);
+    spin_unlock(&dev->clients_lock);
+}
+
+// Where a broadcast reader continues. A lossy reader that fell behind tail
+// may have had its data overwritten, so it skips forward by whole frames to
+// the oldest queued audio and the skip is counted. Called with read_mutex held.
+static unsigned long broadcast_cursor(struct audio_buffer_dev *dev,
+                                      struct audio_buffer_client *client)
+{
+    unsigned long tail = smp_load_acquire(&dev->tail);
+    unsigned long cursor = client->cursor;
+    size_t skip;
+
+    if ((long)(tail - cursor) <= 0)
+        return cursor;
+
+    skip = min_t(size_t, roundup(tail - cursor, FRAME_BYTES), READ_ONCE(dev->head) - cursor);
+    trace_audio_buffer_overrun(dev->minor, READ_ONCE(dev->head), cursor);
+    WRITE_ONCE(client->overruns, client->overruns + 1);
+    WRITE_ONCE(client->skipped_frames, client->skipped_frames + DIV_ROUND_UP(skip, FRAME_BYTES));
+    WRITE_ONCE(client->cursor, cursor + skip);
+    return cursor + skip;
+}
+
+// Move a broadcast reader past bytes it consumed; only the slowest reader
+// that is not lossy moves tail. Called with read_mutex held.
+static void broadcast_advance(struct audio_buffer_dev *dev, struct audio_buffer_client *client,
+                              unsigned long cursor, size_t bytes)
+{
+    spin_lock(&dev->clients_lock);
+    WRITE_ONCE(client->cursor, cursor + bytes);
+    if (cursor == dev->tail && !(client->reader_flags & AUDIO_BUFFER_READER_LOSSY))
+        broadcast_update_tail(dev);
+    spin_unlock(&dev->clients_lock);
+}
+
+// Broadcast mode with only lossy readers: the writer never waits, the oldest
+// whole frames are dropped to make room for want bytes, so readers skipped
+// forward resume on a frame. Returns the space available.
+// Called with write_mutex held.
+static size_t broadcast_make_room(struct audio_buffer_dev *dev, size_t want)
+{
+    size_t space;
+    size_t drop;
+
+    spin_lock(&dev->clients_lock);
+    space = dev->buffer_size - audio_buffer_used(dev);
+    if (!dev->blocking_readers && space < want) {
+        drop = min(roundup(want - space, FRAME_BYTES), audio_buffer_used(dev));
+        audio_buffer_publish_tail(dev, dev->tail + drop);
+        // Readers must see tail move before the freed bytes change
+        smp_wmb();
+        space += drop;
+    }
+    spin_unlock(&dev->clients_lock);
+    return space;
+}
+
+size_t audio_buffer_make_room(struct audio_buffer_dev *dev, size_t want)
+{
+    if (dev->flags & AUDIO_BUFFER_FLAG_BROADCAST)
+        return broadcast_make_room(dev, want);
+    return dev->buffer_size - audio_buffer_used(dev);
+}
+
+// A client's period, capped so that a smaller ring can still satisfy it
+static size_t client_period(struct audio_buffer_client *client)
+{
+    return min(READ_ONCE(client->period), client->dev->buffer_size);
+}
+
+// A reader's period; a converting reader waits for at least a whole frame
+static size_t client_read_period(struct audio_buffer_client *client)
+{
+    if (READ_ONCE(client->conv.frame_bytes))
+        return max_t(size_t, client_period(client), FRAME_BYTES);
+    return client_period(client);
+}
+
+// Fill a plain-mode read waits for before it copies anything
+static size_t read_threshold(struct audio_buffer_client *client)
+{
+    return max(client_read_period(client), audio_buffer_jitter_hold(client->dev));
+}
+
+// Recompute the smallest reader and writer periods after a client change
+static void update_wake_marks(struct audio_buffer_dev *dev)
+{
+    struct audio_buffer_client *client;
+    size_t read_wake = SIZE_MAX;
+    size_t write_wake = SIZE_MAX;
+
+    spin_lock(&dev->clients_lock);
+    list_for_each_entry(client, &dev->clients, node) {
+        if (client->mode & FMODE_READ)
+            read_wake = min(read_wake, client->period);
+        if (client->mode & FMODE_WRITE)
+            write_wake = min(write_wake, client->period);
+    }
+    WRITE_ONCE(dev->read_wake, read_wake == SIZE_MAX ? 1 : read_wake);
+    WRITE_ONCE(dev->write_wake, write_wake == SIZE_MAX ? 1 : write_wake);
+    spin_unlock(&dev->clients_lock);
+}
+
+// Tell sleeping readers, pollers and SIGIO owners that data arrived, but only
+// once at least the smallest reader period is queued
+static void wake_readers(struct audio_buffer_dev *dev)
+{
+    size_t used = audio_buffer_used(dev);
+
+    // An ALSA capture stream has its own wakeup rules
+    audio_alsa_notify(dev, true);
+
+    if (used < max(min(READ_ONCE(dev->read_wake), dev->buffer_size),
+                   audio_buffer_jitter_hold(dev)))
+        return;
+
+    trace_audio_buffer_wake(dev->minor, false, used);
+
+    if (wq_has_sleeper(&dev->read_queue)) {
+        // Pollers are always woken; exclusive workers only one per queued period
+        if (READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_WORKQUEUE)
+            wake_up_interruptible_nr(&dev->read_queue,
+                                     max_t(size_t, used / READ_ONCE(dev->read_wake), 1));
+        else
+            wake_up_interruptible(&dev->read_queue);
+    }
+    kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+// Tell sleeping writers, pollers and SIGIO owners that space was freed, but
+// only once at least the smallest writer period is free
+static void wake_writers(struct audio_buffer_dev *dev)
+{
+    audio_alsa_notify(dev, false);
+    // Mixer-mode writers wait on their inputs, which the mixer drains
+    audio_mixer_kick(dev);
+
+    if (write_space(dev) < min(READ_ONCE(dev->write_wake), dev->buffer_size))
+        return;
+
+    trace_audio_buffer_wake(dev->minor, true, audio_buffer_used(dev));
+
+    if (wq_has_sleeper(&dev->write_queue))
+        wake_up_interruptible(&dev->write_queue);
+    kill_fasync(&dev->async_queue, SIGIO, POLL_OUT);
+}
+
+void audio_buffer_wake_readers(struct audio_buffer_dev *dev)
+{
+    wake_readers(dev);
+}
+
+void audio_buffer_wake_writers(struct audio_buffer_dev *dev)
+{
+    wake_writers(dev);
+}
+
+// IOCB_NOWAIT (io_uring inline submission) and O_NONBLOCK both turn a wait
+// for data or space into -EAGAIN
+static bool io_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+// Take one side's mutex; IOCB_NOWAIT callers must not even sleep on the lock
+static int io_lock(struct kiocb *iocb, struct mutex *lock)
+{
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+// Broadcast read: each file reads the ring from its own cursor, so every
+// reader gets the whole stream from one copy of it
+static ssize_t device_read_broadcast(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct audio_buffer_client *client = iocb->ki_filp->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+    size_t bytes_to_copy;
+    size_t copied;
+    size_t out;
+    size_t data_size;
+    unsigned long cursor;
+    u64 wait_start;
+    int ret;
+
+    ret = io_lock(iocb, &dev->read_mutex);
+    if (ret)
+        return ret;
+
+    for (;;) {
+        // The mode may have changed while we waited
+        if (!(dev->flags & AUDIO_BUFFER_FLAG_BROADCAST)) {
+            mutex_unlock(&dev->read_mutex);
+            return device_read_iter(iocb, to);
+        }
+
+        cursor = broadcast_cursor(dev, client);
+        data_size = smp_load_acquire(&dev->head) - cursor;
+        if (data_size >= client_read_period(client)) {
+            bytes_to_copy = min(client_iter_bytes(client, to), data_size);
+            copied = client_copy_to_iter(client, to, cursor, bytes_to_copy);
+
+            // A lossy reader can be overtaken during the copy; if tail passed
+            // the cursor the data may be torn, so take it back and skip ahead
+            smp_rmb();
+            if ((long)(READ_ONCE(dev->tail) - cursor) <= 0)
+                break;
+            iov_iter_revert(to, client_out_bytes(client, copied));
+            continue;
+        }
+
+        if (data_size == 0) {
+            trace_audio_buffer_underrun(dev->minor, READ_ONCE(dev->head), cursor);
+            audio_stats_inc(dev->stats, AUDIO_STATS_READ, AUDIO_STAT_XRUNS);
+        }
+        trace_audio_buffer_wait(dev->minor, false, client_read_period(client), data_size);
+        mutex_unlock(&dev->read_mutex);
+
+        if (io_nowait(iocb)) {
+            audio_stats_inc(dev->stats, AUDIO_STATS_READ, AUDIO_STAT_EAGAIN);
+            return -EAGAIN;
+        }
+
+        wait_start = ktime_get_ns();
+        ret = wait_event_interruptible(dev->read_queue,
+                                       READ_ONCE(dev->head) - READ_ONCE(client->cursor) >=
+                                       client_read_period(client));
+        audio_stats_wait(dev->stats, AUDIO_STATS_READ, ktime_get_ns() - wait_start);
+        if (ret)
+            return -ERESTARTSYS;
+
+        if (mutex_lock_interruptible(&dev->read_mutex))
+            return -ERESTARTSYS;
+    }
+
+    if (copied == 0) {
+        mutex_unlock(&dev->read_mutex);
+        return -EFAULT;
+    }
+
+    broadcast_advance(dev, client, cursor, copied);
+    out = client_out_bytes(client, copied);
+    mutex_unlock(&dev->read_mutex);
+    trace_audio_buffer_read(dev->minor, cursor & dev->buffer_mask, copied,
+                            data_size - copied, dev->buffer_size);
+    audio_stats_io(dev->stats, AUDIO_STATS_READ, copied, data_size - copied);
+
+    // The slowest reader may have freed space
+    wake_writers(dev);
+
+    return out;
+}
+
+// Work-queue read: hand this reader exactly one period of whole frames (less
+// only if its buffer is smaller). Sleepers are exclusive waiters, so each
+// period wakes one worker and no frame is ever split between two of them.
+static ssize_t device_read_work(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct audio_buffer_client *client = iocb->ki_filp->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+    size_t data_size;
+    size_t copied;
+    size_t out;
+    size_t want;
+    unsigned long tail;
+    u64 wait_start;
+    int ret;
+
+    want = min(max_t(size_t, audio_ring_frames(client_period(client), FRAME_BYTES), FRAME_BYTES),
+               audio_ring_frames(client_iter_bytes(client, to), FRAME_BYTES));
+    if (!want)
+        return -EINVAL;
+
+    ret = io_lock(iocb, &dev->read_mutex);
+    if (ret)
+        return ret;
+
+    while ((data_size = audio_buffer_used(dev)) < want) {
+        if (data_size == 0) {
+            trace_audio_buffer_underrun(dev->minor, READ_ONCE(dev->head), dev->tail);
+            audio_stats_inc(dev->stats, AUDIO_STATS_READ, AUDIO_STAT_XRUNS);
+        }
+        trace_audio_buffer_wait(dev->minor, false, want, data_size);
+        mutex_unlock(&dev->read_mutex);
+
+        if (io_nowait(iocb)) {
+            audio_stats_inc(dev->stats, AUDIO_STATS_READ, AUDIO_STAT_EAGAIN);
+            return -EAGAIN;
+        }
+
+        // Leaving the mode wakes every worker so it can read the normal way
+        wait_start = ktime_get_ns();
+        ret = wait_event_interruptible_exclusive(dev->read_queue,
+                audio_buffer_used(dev) >= want ||
+                !(READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_WORKQUEUE));
+        audio_stats_wait(dev->stats, AUDIO_STATS_READ, ktime_get_ns() - wait_start);
+        if (ret)
+            return -ERESTARTSYS;
+
+        if (mutex_lock_interruptible(&dev->read_mutex))
+            return -ERESTARTSYS;
+        if (!(dev->flags & AUDIO_BUFFER_FLAG_WORKQUEUE)) {
+            mutex_unlock(&dev->read_mutex);
+            return device_read_iter(iocb, to);
+        }
+    }
+
+    if (audio_buffer_consumer_busy(dev)) {
+        mutex_unlock(&dev->read_mutex);
+        return -EBUSY;
+    }
+
+    // A fault part way through still hands back only whole frames
+    tail = dev->tail;
+    copied = audio_ring_frames(client_copy_to_iter(client, to, tail, want), FRAME_BYTES);
+    if (copied == 0) {
+        mutex_unlock(&dev->read_mutex);
+        return -EFAULT;
+    }
+
+    audio_buffer_publish_tail(dev, tail + copied);
+    out = client_out_bytes(client, copied);
+    mutex_unlock(&dev->read_mutex);
+    trace_audio_buffer_read(dev->minor, tail & dev->buffer_mask, copied,
+                            data_size - copied, dev->buffer_size);
+    audio_stats_io(dev->stats, AUDIO_STATS_READ, copied, data_size - copied);
+
+    wake_writers(dev);
+    return out;
+}
+
+// Reads drain as much as is queued into every segment of the iterator, so one
+// readv or io_uring request can take several periods at once
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct audio_buffer_client *client = iocb->ki_filp->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+    size_t bytes_to_copy;
+    size_t copied;
+    size_t out;
+    size_t data_size;
+    unsigned long tail;
+    u64 wait_start;
+    int ret;
+    
+    if (!iov_iter_count(to))
+        return 0;
+    // A converting reader needs room for at least one frame in its format
+    if (!client_iter_bytes(client, to))
+        return -EINVAL;
+    
+    if (READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_BROADCAST)
+        return device_read_broadcast(iocb, to);
+    if (READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_WORKQUEUE)
+        return device_read_work(iocb, to);
+    
+    // Serialize against other readers only; the writer never takes read_mutex
+    ret = io_lock(iocb, &dev->read_mutex);
+    if (ret)
+        return ret;
+    
+    // Wait until at least a period, and whatever the jitter buffer holds back, is queued
+    while ((data_size = audio_buffer_used(dev)) < read_threshold(client)) {
+        if (data_size == 0) {
+            trace_audio_buffer_underrun(dev->minor, READ_ONCE(dev->head), dev->tail);
+            audio_stats_inc(dev->stats, AUDIO_STATS_READ, AUDIO_STAT_XRUNS);
+            audio_jitter_consume(&dev->jitter, 0);
+        }
+        trace_audio_buffer_wait(dev->minor, false, client_period(client), data_size);
+        mutex_unlock(&dev->read_mutex);
+        
+        if (io_nowait(iocb)) {
+            audio_stats_inc(dev->stats, AUDIO_STATS_READ, AUDIO_STAT_EAGAIN);
+            return -EAGAIN;
+        }
+        
+        wait_start = ktime_get_ns();
+        ret = wait_event_interruptible(dev->read_queue, audio_buffer_used(dev) >= read_threshold(client));
+        audio_stats_wait(dev->stats, AUDIO_STATS_READ, ktime_get_ns() - wait_start);
+        if (ret)
+            return -ERESTARTSYS;
+        
+        if (mutex_lock_interruptible(&dev->read_mutex))
+            return -ERESTARTSYS;
+    }
+    
+    // Broadcast or work-queue mode may have been switched on while we waited
+    if (dev->flags & AUDIO_BUFFER_FLAG_BROADCAST) {
+        mutex_unlock(&dev->read_mutex);
+        return device_read_broadcast(iocb, to);
+    }
+    if (dev->flags & AUDIO_BUFFER_FLAG_WORKQUEUE) {
+        mutex_unlock(&dev->read_mutex);
+        return device_read_work(iocb, to);
+    }
+    
+    // The virtual clock or an ALSA capture stream is the consumer while it runs
+    if (audio_buffer_consumer_busy(dev)) {
+        mutex_unlock(&dev->read_mutex);
+        return -EBUSY;
+    }
+    audio_jitter_consume(&dev->jitter, data_size);
+    
+    // Calculate how many bytes to copy
+    bytes_to_copy = min(client_iter_bytes(client, to), data_size);
+    tail = dev->tail;
+    
+    // Only what actually reached userspace is consumed
+    copied = client_copy_to_iter(client, to, tail, bytes_to_copy);
+    if (copied == 0) {
+        mutex_unlock(&dev->read_mutex);
+        return -EFAULT;
+    }
+    
+    // Hand the space back to the writer
+    audio_buffer_publish_tail(dev, tail + copied);
+    out = client_out_bytes(client, copied);
+    mutex_unlock(&dev->read_mutex);
+    trace_audio_buffer_read(dev->minor, tail & dev->buffer_mask, copied,
+                            data_size - copied, dev->buffer_size);
+    audio_stats_io(dev->stats, AUDIO_STATS_READ, copied, data_size - copied);
+    
+    // Wake up any writers waiting for space
+    wake_writers(dev);
+    
+    return out;
+}
+
+// Multi-producer write: reserve a frame-aligned region with a cmpxchg on
+// reserve, copy into it without a lock, then publish it by advancing head once
+// every earlier reservation has been published.
+static ssize_t device_write_mpsc(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct audio_buffer_client *client = iocb->ki_filp->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+    size_t bytes_to_copy;
+    size_t space_available;
+    size_t copied;
+    unsigned long start;
+    size_t len;
+    u64 wait_start;
+    int ret;
+
+    len = audio_ring_frames(iov_iter_count(from), FRAME_BYTES);
+    if (len == 0)
+        return -EINVAL;
+
+    // Shared with other writers; excludes mode changes, reset and resize
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!down_read_trylock(&dev->config_rwsem))
+            return -EAGAIN;
+    } else if (down_read_interruptible(&dev->config_rwsem)) {
+        return -ERESTARTSYS;
+    }
+
+    start = READ_ONCE(dev->reserve);
+    for (;;) {
+        // The mode may have been switched back before we got the semaphore
+        if (!(dev->flags & AUDIO_BUFFER_FLAG_MPSC)) {
+            up_read(&dev->config_rwsem);
+            return device_write_iter(iocb, from);
+        }
+        // Nor may head have been claimed; claims hold config_rwsem for writing
+        if (audio_buffer_producer_busy(dev)) {
+            up_read(&dev->config_rwsem);
+            return -EBUSY;
+        }
+
+        // Wait until at least a period (and a whole frame) is free
+        space_available = audio_ring_frames(audio_ring_space(dev->buffer_size, start,
+                                                             smp_load_acquire(&dev->tail)),
+                                            FRAME_BYTES);
+        if (space_available == 0 || space_available < client_period(client)) {
+            if (space_available == 0) {
+                trace_audio_buffer_overrun(dev->minor, start, smp_load_acquire(&dev->tail));
+                audio_stats_inc(dev->stats, AUDIO_STATS_WRITE, AUDIO_STAT_XRUNS);
+            }
+            trace_audio_buffer_wait(dev->minor, true, client_period(client),
+                                    dev->buffer_size - space_available);
+            up_read(&dev->config_rwsem);
+
+            if (io_nowait(iocb)) {
+                audio_stats_inc(dev->stats, AUDIO_STATS_WRITE, AUDIO_STAT_EAGAIN);
+                return -EAGAIN;
+            }
+
+            wait_start = ktime_get_ns();
+            ret = wait_event_interruptible(dev->write_queue,
+                                           mpsc_space(dev) >= max_t(size_t, client_period(client), FRAME_BYTES));
+            audio_stats_wait(dev->stats, AUDIO_STATS_WRITE, ktime_get_ns() - wait_start);
+            if (ret)
+                return -ERESTARTSYS;
+
+            if (down_read_interruptible(&dev->config_rwsem))
+                return -ERESTARTSYS;
+
+            start = READ_ONCE(dev->reserve);
+            continue;
+        }
+
+        // Nonblocking writers may not wait below for earlier reservations
+        // to be published, so they only reserve once there are none
+        if (io_nowait(iocb) && smp_load_acquire(&dev->head) != start) {
+            up_read(&dev->config_rwsem);
+            audio_stats_inc(dev->stats, AUDIO_STATS_WRITE, AUDIO_STAT_EAGAIN);
+            return -EAGAIN;
+        }
+
+        bytes_to_copy = min(len, space_available);
+        if (try_cmpxchg(&dev->reserve, &start, start + bytes_to_copy))
+            break;
+    }
+
+    // The region is ours. After a short copy, hand back the part past the
+    // last whole frame if nobody has reserved behind us; otherwise it has to
+    // be published to keep order, so it goes out as silence.
+    copied = ring_copy_from_iter(dev, start, from, bytes_to_copy);
+    if (copied < bytes_to_copy) {
+        iov_iter_revert(from, copied % FRAME_BYTES);
+        copied = audio_ring_frames(copied, FRAME_BYTES);
+        if (cmpxchg(&dev->reserve, start + bytes_to_copy, start + copied) == start + bytes_to_copy) {
+            bytes_to_copy = copied;
+        } else {
+            audio_ring_clear(dev->buffer, dev->buffer_size, start + copied, bytes_to_copy - copied);
+            // Report what was published, so the caller doesn't send it again
+            if (copied) {
+                iov_iter_advance(from, bytes_to_copy - copied);
+                copied = bytes_to_copy;
+            }
+        }
+    }
+
+    // Earlier reservations must become visible first. They are already
+    // copying, so this only waits for a memcpy; nonblocking writers never
+    // get here with one outstanding.
+    wait_event(dev->commit_queue, smp_load_acquire(&dev->head) == start);
+    audio_buffer_publish_write(dev, start, bytes_to_copy);
+    dev->is_playing = true;
+    trace_audio_buffer_write(dev->minor, start & dev->buffer_mask, bytes_to_copy,
+                             audio_buffer_used(dev), dev->buffer_size);
+    audio_stats_io(dev->stats, AUDIO_STATS_WRITE, bytes_to_copy, audio_buffer_used(dev));
+    up_read(&dev->config_rwsem);
+
+    if (wq_has_sleeper(&dev->commit_queue))
+        wake_up_all(&dev->commit_queue);
+    wake_readers(dev);
+
+    return copied ? copied : -EFAULT;
+}
+
+// Mixer write: queue into this file's own input, then let the mixer sum
+// whatever every input now has into the ring
+static ssize_t device_write_mix(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct audio_buffer_client *client = iocb->ki_filp->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+    struct audio_mixer_input *input;
+    size_t period = min_t(size_t, READ_ONCE(client->period), AUDIO_MIXER_INPUT_SIZE);
+    size_t space_available;
+    size_t copied;
+    u64 wait_start;
+    int ret;
+
+    // Creating the input may sleep
+    if ((iocb->ki_flags & IOCB_NOWAIT) && !READ_ONCE(client->input))
+        return -EAGAIN;
+    input = audio_mixer_attach(dev, client);
+    if (IS_ERR(input))
+        return PTR_ERR(input);
+
+    // Shared with other writers; excludes mode changes and reset
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!down_read_trylock(&dev->config_rwsem))
+            return -EAGAIN;
+    } else if (down_read_interruptible(&dev->config_rwsem)) {
+        return -ERESTARTSYS;
+    }
+    ret = io_lock(iocb, &input->lock);
+    if (ret) {
+        up_read(&dev->config_rwsem);
+        return ret;
+    }
+
+    for (;;) {
+        // The mode may have been switched off while we waited
+        if (!(dev->flags & AUDIO_BUFFER_FLAG_MIX)) {
+            mutex_unlock(&input->lock);
+            up_read(&dev->config_rwsem);
+            return device_write_iter(iocb, from);
+        }
+        if (audio_buffer_producer_busy(dev)) {
+            mutex_unlock(&input->lock);
+            up_read(&dev->config_rwsem);
+            return -EBUSY;
+        }
+
+        space_available = audio_mixer_input_space(input);
+        if (space_available >= period)
+            break;
+
+        trace_audio_buffer_wait(dev->minor, true, period,
+                                AUDIO_MIXER_INPUT_SIZE - space_available);
+        mutex_unlock(&input->lock);
+        up_read(&dev->config_rwsem);
+
+        if (io_nowait(iocb)) {
+            audio_stats_inc(dev->stats, AUDIO_STATS_WRITE, AUDIO_STAT_EAGAIN);
+            return -EAGAIN;
+        }
+
+        wait_start = ktime_get_ns();
+        ret = wait_event_interruptible(dev->write_queue,
+                                       audio_mixer_input_space(input) >= period ||
+                                       !(READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_MIX));
+        audio_stats_wait(dev->stats, AUDIO_STATS_WRITE, ktime_get_ns() - wait_start);
+        if (ret)
+            return -ERESTARTSYS;
+
+        if (down_read_interruptible(&dev->config_rwsem))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&input->lock)) {
+            up_read(&dev->config_rwsem);
+            return -ERESTARTSYS;
+        }
+    }
+
+    copied = audio_mixer_copy_in(input, from, min(iov_iter_count(from), space_available));
+    if (copied == 0) {
+        mutex_unlock(&input->lock);
+        up_read(&dev->config_rwsem);
+        return -EFAULT;
+    }
+    WRITE_ONCE(input->started, true);
+    smp_store_release(&input->head, input->head + copied);
+    mutex_unlock(&input->lock);
+    up_read(&dev->config_rwsem);
+    audio_stats_io(dev->stats, AUDIO_STATS_WRITE, copied,
+                   AUDIO_MIXER_INPUT_SIZE - space_available + copied);
+
+    // IOCB_NOWAIT callers must not wait for write_mutex; the worker mixes instead
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        audio_mixer_schedule(dev);
+    else
+        audio_mixer_run(dev);
+
+    return copied;
+}
+
+// Writes fill as much space as is free from every segment of the iterator, so
+// one writev or io_uring request can queue several periods at once
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct audio_buffer_client *client = iocb->ki_filp->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+    size_t bytes_to_copy;
+    size_t space_available;
+    size_t copied;
+    unsigned long head;
+    u64 wait_start;
+    int ret;
+    
+    if (!iov_iter_count(from))
+        return 0;
+    
+    // An ALSA playback stream or in-kernel producer owns head
+    if (audio_buffer_producer_busy(dev))
+        return -EBUSY;
+    
+    if (READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_MPSC)
+        return device_write_mpsc(iocb, from);
+    if (READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_MIX)
+        return device_write_mix(iocb, from);
+    
+    // Serialize against other writers only; the reader never takes write_mutex
+    ret = io_lock(iocb, &dev->write_mutex);
+    if (ret)
+        return ret;
+    
+    for (;;) {
+        // head may have been claimed while we waited; claims take write_mutex
+        if (audio_buffer_producer_busy(dev)) {
+            mutex_unlock(&dev->write_mutex);
+            return -EBUSY;
+        }
+        
+        // The mode may have changed while we waited for the lock
+        if (dev->flags & AUDIO_BUFFER_FLAG_MPSC) {
+            mutex_unlock(&dev->write_mutex);
+            return device_write_mpsc(iocb, from);
+        }
+        if (dev->flags & AUDIO_BUFFER_FLAG_MIX) {
+            mutex_unlock(&dev->write_mutex);
+            return device_write_mix(iocb, from);
+        }
+        
+        // Calculate available space
+        space_available = dev->buffer_size - audio_buffer_used(dev);
+        
+        // Lossy mode never makes the producer wait, unless the ring is full
+        // and a reader is still copying out the frames it would drop
+        if (dev->flags & AUDIO_BUFFER_FLAG_OVERWRITE) {
+            space_available = overwrite_oldest(dev, min(iov_iter_count(from), dev->buffer_size),
+                                               false);
+            if (space_available)
+                break;
+            if (io_nowait(iocb)) {
+                mutex_unlock(&dev->write_mutex);
+                audio_stats_inc(dev->stats, AUDIO_STATS_WRITE, AUDIO_STAT_EAGAIN);
+                return -EAGAIN;
+            }
+            space_available = overwrite_oldest(dev, min(iov_iter_count(from), dev->buffer_size),
+                                               true);
+            break;
+        }
+        
+        // So is broadcast mode with only lossy readers
+        if (dev->flags & AUDIO_BUFFER_FLAG_BROADCAST)
+            space_available = broadcast_make_room(dev, min(iov_iter_count(from), dev->buffer_size));
+        
+        if (space_available >= client_period(client))
+            break;
+        
+        // Wait until at least a period is free
+        if (space_available == 0) {
+            trace_audio_buffer_overrun(dev->minor, dev->head, READ_ONCE(dev->tail));
+            audio_stats_inc(dev->stats, AUDIO_STATS_WRITE, AUDIO_STAT_XRUNS);
+        }
+        trace_audio_buffer_wait(dev->minor, true, client_period(client),
+                                dev->buffer_size - space_available);
+        mutex_unlock(&dev->write_mutex);
+        
+        if (io_nowait(iocb)) {
+            audio_stats_inc(dev->stats, AUDIO_STATS_WRITE, AUDIO_STAT_EAGAIN);
+            return -EAGAIN;
+        }
+        
+        wait_start = ktime_get_ns();
+        ret = wait_event_interruptible(dev->write_queue, 
+                                       write_space(dev) >= client_period(client));
+        audio_stats_wait(dev->stats, AUDIO_STATS_WRITE, ktime_get_ns() - wait_start);
+        if (ret)
+            return -ERESTARTSYS;
+        
+        if (mutex_lock_interruptible(&dev->write_mutex))
+            return -ERESTARTSYS;
+    }
+    
+    // Calculate how many bytes to copy
+    bytes_to_copy = min(iov_iter_count(from), space_available);
+    head = dev->head;
+    
+    // Only what actually arrived from userspace is published
+    copied = ring_copy_from_iter(dev, head, from, bytes_to_copy);
+    if (copied == 0) {
+        mutex_unlock(&dev->write_mutex);
+        return -EFAULT;
+    }
+    
+    // Publish the data to the reader and set playing flag
+    audio_buffer_publish_write(dev, head, copied);
+    dev->is_playing = true;
+    mutex_unlock(&dev->write_mutex);
+    trace_audio_buffer_write(dev->minor, head & dev->buffer_mask, copied,
+                             dev->buffer_size - space_available + copied,
+                             dev->buffer_size);
+    audio_stats_io(dev->stats, AUDIO_STATS_WRITE, copied,
+                   dev->buffer_size - space_available + copied);
+    
+    // Wake up any readers waiting for data
+    wake_readers(dev);
+    
+    return copied;
+}
+
+// Fill in a position snapshot. head, tail and the write marks are read without
+// locks and retried until neither side moved during the read.
+static void get_position(struct audio_buffer_dev *dev, struct audio_buffer_position *pos)
+{
+    const struct audio_buffer_mark *mark;
+    unsigned long head, tail, nr, i;
+    unsigned int seq;
+    u64 oldest;
+
+    do {
+        seq = read_seqcount_begin(&dev->pos_seq);
+        tail = smp_load_acquire(&dev->tail);
+        head = dev->head;
+        nr = dev->nr_marks;
+        oldest = 0;
+
+        // The oldest queued byte belongs to the newest write that started at
+        // or before tail. If that mark was recycled, the oldest remaining mark
+        // is the best (slightly late) estimate.
+        if (head != tail) {
+            for (i = nr; i > 0 && nr - i < AUDIO_BUFFER_MARKS; i--) {
+                mark = &dev->marks[(i - 1) & (AUDIO_BUFFER_MARKS - 1)];
+                oldest = mark->ns;
+                if ((long)(tail - mark->index) >= 0)
+                    break;
+            }
+        }
+    } while (read_seqcount_retry(&dev->pos_seq, seq) ||
+             tail != smp_load_acquire(&dev->tail));
+
+    pos->frames_queued = (head - tail) / FRAME_BYTES;
+    pos->frames_written = head / FRAME_BYTES;
+    pos->frames_read = tail / FRAME_BYTES;
+    pos->oldest_ns = oldest;
+    pos->now_ns = ktime_get_ns();
+}
+
+// Reset, resize and mode changes touch both ends of the ring
+static void lock_both_sides(struct audio_buffer_dev *dev)
+{
+    down_write(&dev->config_rwsem);
+    mutex_lock(&dev->write_mutex);
+    mutex_lock(&dev->read_mutex);
+    // The clock consumes without locks, so it has to be stopped as well
+    audio_clock_pause(dev);
+}
+
+static void unlock_both_sides(struct audio_buffer_dev *dev)
+{
+    audio_clock_resume(dev);
+    mutex_unlock(&dev->read_mutex);
+    mutex_unlock(&dev->write_mutex);
+    up_write(&dev->config_rwsem);
+}
+
+static unsigned long reset_aligned_locked(struct audio_buffer_dev *dev)
+{
+    unsigned long base;
+
+    base = round_up(dev->head, dev->buffer_size);
+    trace_audio_buffer_reset(dev->minor, audio_buffer_used(dev));
+    dev->reserve = base;
+    audio_buffer_publish_head(dev, base);
+    audio_buffer_publish_tail(dev, base);
+    if (dev->flags & AUDIO_BUFFER_FLAG_BROADCAST)
+        broadcast_reset_cursors(dev, base);
+    audio_mixer_reset(dev);
+    audio_jitter_restart(dev);
+    dev->is_playing = false;
+    return base;
+}
+
+// Drop everything queued and restart the ring at a multiple of its size, so
+// that ring offset 0 is stream offset 0 again. Returns the new head and tail.
+unsigned long audio_buffer_reset_aligned(struct audio_buffer_dev *dev)
+{
+    unsigned long base;
+
+    lock_both_sides(dev);
+    base = reset_aligned_locked(dev);
+    unlock_both_sides(dev);
+    wake_writers(dev);
+    return base;
+}
+
+// Hand one end of the ring to a prepared ALSA stream, restarted aligned as
+// for audio_buffer_reset_aligned. With both sides locked no reader or writer
+// is part way through a transfer, and every one re-checks the owners once it
+// has its lock again. A playback client may fill the ring before it starts,
+// so the end is owned from here rather than from trigger START.
+int audio_buffer_alsa_claim(struct audio_buffer_dev *dev, bool capture, unsigned long *base)
+{
+    lock_both_sides(dev);
+    // Only one consumer may own tail, nor may anything but the mixer produce while it is on
+    if (capture ? (READ_ONCE(dev->clock.running) || dev->kernel_consumer ||
+                   (dev->flags & (AUDIO_BUFFER_FLAG_OVERWRITE | AUDIO_BUFFER_FLAG_BROADCAST))) :
+                  (dev->kernel_producer || (dev->flags & AUDIO_BUFFER_FLAG_MIX))) {
+        unlock_both_sides(dev);
+        return -EBUSY;
+    }
+    *base = reset_aligned_locked(dev);
+    WRITE_ONCE(dev->alsa.owned, true);
+    unlock_both_sides(dev);
+    wake_writers(dev);
+    return 0;
+}
+
+// The stream no longer touches the ring; file readers and writers may resume
+void audio_buffer_alsa_release(struct audio_buffer_dev *dev)
+{
+    WRITE_ONCE(dev->alsa.owned, false);
+    wake_readers(dev);
+    wake_writers(dev);
+}
+
+// Claim one end of the ring for an in-kernel client, see audio_buffer.h
+int audio_buffer_attach(struct audio_buffer_dev *dev, enum audio_buffer_end end)
+{
+    int ret;
+
+    ret = audio_buffer_get_ring(dev);
+    if (ret)
+        return ret;
+
+    lock_both_sides(dev);
+    spin_lock_irq(&dev->alsa.lock);
+    if (dev->alsa.substream)
+        ret = -EBUSY;
+    else if (end == AUDIO_BUFFER_PRODUCER &&
+             (audio_buffer_producer_busy(dev) || (dev->flags & AUDIO_BUFFER_FLAG_MIX)))
+        ret = -EBUSY;
+    else if (end == AUDIO_BUFFER_CONSUMER &&
+             (audio_buffer_consumer_busy(dev) ||
+              (dev->flags & (AUDIO_BUFFER_FLAG_OVERWRITE | AUDIO_BUFFER_FLAG_BROADCAST))))
+        ret = -EBUSY;
+
+    if (!ret) {
+        // The client holds pointers into the ring, so it must not be resized
+        atomic_inc(&dev->mmap_count);
+        if (end == AUDIO_BUFFER_PRODUCER)
+            WRITE_ONCE(dev->kernel_producer, true);
+        else
+            WRITE_ONCE(dev->kernel_consumer, true);
+    }
+    spin_unlock_irq(&dev->alsa.lock);
+    unlock_both_sides(dev);
+    if (ret)
+        audio_buffer_put_ring(dev);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(audio_buffer_attach);
+
+// The client must have stopped calling acquire, commit and release for end
+void audio_buffer_detach(struct audio_buffer_dev *dev, enum audio_buffer_end end)
+{
+    lock_both_sides(dev);
+    if (end == AUDIO_BUFFER_PRODUCER) {
+        WRITE_ONCE(dev->kernel_producer, false);
+        // Published without reservations, so MPSC writers start from head
+        dev->reserve = dev->head;
+    } else {
+        WRITE_ONCE(dev->kernel_consumer, false);
+    }
+    atomic_dec(&dev->mmap_count);
+    unlock_both_sides(dev);
+    wake_readers(dev);
+    wake_writers(dev);
+    audio_buffer_put_ring(dev);
+}
+EXPORT_SYMBOL_GPL(audio_buffer_detach);
+
+static size_t region_fill(struct audio_buffer_dev *dev, unsigned long index, size_t bytes,
+                          struct audio_buffer_region *region)
+{
+    struct audio_ring_span span = audio_ring_span(dev->buffer_size, index, bytes);
+
+    region->data[0] = dev->buffer + span.pos;
+    region->len[0] = span.first;
+    region->data[1] = dev->buffer;
+    region->len[1] = span.second;
+    return bytes;
+}
+
+// Free whole frames at head, at most bytes of them
+size_t audio_buffer_write_acquire(struct audio_buffer_dev *dev, size_t bytes,
+                                  struct audio_buffer_region *region)
+{
+    size_t space = dev->buffer_size - audio_buffer_used(dev);
+
+    return region_fill(dev, dev->head, audio_ring_frames(min(bytes, space), FRAME_BYTES),
+                       region);
+}
+EXPORT_SYMBOL_GPL(audio_buffer_write_acquire);
+
+// Publish bytes filled at head
+int audio_buffer_write_commit(struct audio_buffer_dev *dev, size_t bytes)
+{
+    unsigned long head = dev->head;
+
+    if (bytes % FRAME_BYTES || bytes > dev->buffer_size - audio_buffer_used(dev))
+        return -EINVAL;
+    if (!bytes)
+        return 0;
+    trace_audio_buffer_write(dev->minor, head & dev->buffer_mask, bytes,
+                             audio_buffer_used(dev) + bytes, dev->buffer_size);
+    audio_buffer_publish_write(dev, head, bytes);
+    wake_readers(dev);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(audio_buffer_write_commit);
+
+// Queued whole frames at tail, at most bytes of them
+size_t audio_buffer_read_acquire(struct audio_buffer_dev *dev, size_t bytes,
+                                 struct audio_buffer_region *region)
+{
+    return region_fill(dev, dev->tail,
+                       audio_ring_frames(min(bytes, audio_buffer_used(dev)), FRAME_BYTES),
+                       region);
+}
+EXPORT_SYMBOL_GPL(audio_buffer_read_acquire);
+
+// Free bytes consumed at tail
+int audio_buffer_read_release(struct audio_buffer_dev *dev, size_t bytes)
+{
+    unsigned long tail = dev->tail;
+    size_t used = audio_buffer_used(dev);
+
+    if (bytes % FRAME_BYTES || bytes > used)
+        return -EINVAL;
+    if (!bytes)
+        return 0;
+    audio_buffer_publish_tail(dev, tail + bytes);
+    trace_audio_buffer_read(dev->minor, tail & dev->buffer_mask, bytes, used - bytes,
+                            dev->buffer_size);
+    wake_writers(dev);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(audio_buffer_read_release);
+
+static __poll_t device_poll(struct file *filep, poll_table *wait)
+{
+    struct audio_buffer_client *client = filep->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+    size_t period = client_period(client);
+    size_t read_period = client_read_period(client);
+    __poll_t mask = 0;
+    size_t queued;
+    size_t space;
+
+    poll_wait(filep, &dev->read_queue, wait);
+    poll_wait(filep, &dev->write_queue, wait);
+
+    // Ready means a whole period can be transferred
+    if (filep->f_mode & FMODE_READ) {
+        if (READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_BROADCAST)
+            queued = READ_ONCE(dev->head) - READ_ONCE(client->cursor);
+        else
+            queued = audio_buffer_used(dev);
+        if (queued >= max(read_period, audio_buffer_jitter_hold(dev)))
+            mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    if (filep->f_mode & FMODE_WRITE) {
+        // Mixer-mode writers queue into their own input
+        if (READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_MIX) {
+            space = client->input ? audio_mixer_input_space(client->input) : AUDIO_MIXER_INPUT_SIZE;
+            period = min_t(size_t, period, AUDIO_MIXER_INPUT_SIZE);
+        } else {
+            space = write_space(dev);
+        }
+        if (space > 0 && space >= period)
+            mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+static int device_fasync(int fd, struct file *filep, int on)
+{
+    struct audio_buffer_client *client = filep->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+
+    return fasync_helper(fd, filep, on, &dev->async_queue);
+}
+
+// Drop everything queued (AUDIO_BUFFER_IOCTL_RESET)
+static int ring_reset(struct audio_buffer_dev *dev)
+{
+    lock_both_sides(dev);
+    // In-kernel clients keep their own view of head and tail
+    if (audio_buffer_kernel_attached(dev)) {
+        unlock_both_sides(dev);
+        return -EBUSY;
+    }
+    trace_audio_buffer_reset(dev->minor, audio_buffer_used(dev));
+    audio_buffer_publish_tail(dev, dev->head);
+    if (dev->flags & AUDIO_BUFFER_FLAG_BROADCAST)
+        broadcast_reset_cursors(dev, dev->head);
+    audio_mixer_reset(dev);
+    audio_jitter_restart(dev);
+    dev->is_playing = false;
+    unlock_both_sides(dev);
+    wake_writers(dev);
+    audio_buffer_dbg("Device %u reset\n", dev->minor);
+    return 0;
+}
+
+// Move the ring to a new allocation of new_size bytes (AUDIO_BUFFER_IOCTL_SET_SIZE)
+static int ring_resize(struct audio_buffer_dev *dev, size_t new_size)
+{
+    void *new_buffer;
+    void *old_buffer;
+
+    // Must be between one byte and MAX_BUFFER_SIZE
+    if (new_size == 0 || new_size > MAX_BUFFER_SIZE) {
+        printk(KERN_ERR "Audio Buffer: new size must be between 1 and %d bytes\n", MAX_BUFFER_SIZE);
+        return -EINVAL;
+    }
+    // Power-of-two sizes let the ring wrap with a mask
+    new_size = roundup_pow_of_two(new_size);
+
+    // Allocated before taking the locks so I/O only stalls for the copy
+    new_buffer = vmalloc_user(new_size);
+    if (!new_buffer) {
+        printk(KERN_ERR "Audio Buffer: Failed to allocate new buffer");
+        return -ENOMEM;
+    }
+
+    // ring_mutex keeps new mappings out until the old ring is gone
+    mutex_lock(&dev->ring_mutex);
+    lock_both_sides(dev);
+    // Mapped clients still point at the old pages
+    if (atomic_read(&dev->mmap_count)) {
+        unlock_both_sides(dev);
+        mutex_unlock(&dev->ring_mutex);
+        vfree(new_buffer);
+        return -EBUSY;
+    }
+    // Shrinking below the queued data would drop audio
+    if (audio_buffer_used(dev) > new_size) {
+        unlock_both_sides(dev);
+        mutex_unlock(&dev->ring_mutex);
+        vfree(new_buffer);
+        return -EBUSY;
+    }
+    trace_audio_buffer_resize(dev->minor, dev->buffer_size, new_size);
+    // Move the queued data over; head, tail and reserve keep counting
+    audio_ring_migrate(new_buffer, new_size, dev->buffer, dev->buffer_size,
+                       dev->tail, audio_buffer_used(dev));
+    old_buffer = dev->buffer;
+    dev->buffer = new_buffer;
+    dev->buffer_size = new_size;
+    dev->buffer_mask = new_size - 1;
+    dev->ctrl->buffer_size = new_size;
+    unlock_both_sides(dev);
+    mutex_unlock(&dev->ring_mutex);
+    vfree(old_buffer);
+    // A bigger ring may have room for blocked writers
+    wake_writers(dev);
+    printk(KERN_INFO "Audio Buffer: new size set to %zu\n", new_size);
+    return 0;
+}
+
+static long device_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    struct audio_buffer_client *client = filep->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+    size_t new_size;
+    size_t count;
+    unsigned int flags;
+    unsigned int changed;
+    struct audio_buffer_status status;
+    struct audio_buffer_position position;
+    struct audio_buffer_clock clock;
+    struct audio_buffer_clock_status clock_status;
+    struct audio_buffer_reader_status reader;
+    struct audio_buffer_jitter jitter;
+    struct audio_buffer_jitter_status jitter_status;
+    struct audio_buffer_format format;
+    struct audio_convert conv;
+    unsigned char *conv_buf;
+    unsigned long cursor;
+    u32 gain;
+    int ret = 0;
+
+    switch(cmd){
+        case AUDIO_BUFFER_IOCTL_RESET:
+            //Resets the audio buffer by dropping everything queued
+            return ring_reset(dev);
+        case AUDIO_BUFFER_IOCTL_GET_SIZE:
+            ret = copy_to_user((size_t __user *)arg, &dev->buffer_size, sizeof(size_t));
+            if(ret){
+                printk(KERN_ERR "Audio Buffer: failed to get buffer size");
+                return -EFAULT;
+            }
+            break;
+        case AUDIO_BUFFER_IOCTL_SET_SIZE:
+            //copies the new buffer size from the user
+            ret = copy_from_user(&new_size, (size_t __user *)arg, sizeof(size_t));
+            if(ret){
+                printk(KERN_ERR "Audio Buffer: failed to set buffer size");
+                return -EFAULT;
+            }
+            return ring_resize(dev, new_size);
+        case AUDIO_BUFFER_IOCTL_COMMIT_WRITE:
+            //Publishes bytes a client wrote directly into the mapped ring
+            if(copy_from_user(&count, (size_t __user *)arg, sizeof(size_t)))
+                return -EFAULT;
+            mutex_lock(&dev->write_mutex);
+            if(audio_buffer_producer_busy(dev)){
+                mutex_unlock(&dev->write_mutex);
+                return -EBUSY;
+            }
+            //In overwrite mode the producer may have written over unread frames
+            if((dev->flags & AUDIO_BUFFER_FLAG_OVERWRITE) && count <= dev->buffer_size)
+                overwrite_oldest(dev, count, true);
+            if((dev->flags & AUDIO_BUFFER_FLAG_BROADCAST) && count <= dev->buffer_size)
+                broadcast_make_room(dev, count);
+            //Mapped writers cannot take part in MPSC reservations or be mixed
+            if((dev->flags & (AUDIO_BUFFER_FLAG_MPSC | AUDIO_BUFFER_FLAG_MIX)) ||
+               count > dev->buffer_size - audio_buffer_used(dev)){
+                mutex_unlock(&dev->write_mutex);
+                return -EINVAL;
+            }
+            audio_buffer_publish_write(dev, dev->head, count);
+            dev->is_playing = true;
+            mutex_unlock(&dev->write_mutex);
+            audio_stats_io(dev->stats, AUDIO_STATS_WRITE, count, audio_buffer_used(dev));
+            wake_readers(dev);
+            break;
+        case AUDIO_BUFFER_IOCTL_COMMIT_READ:
+            //Releases bytes a client consumed directly from the mapped ring
+            if(copy_from_user(&count, (size_t __user *)arg, sizeof(size_t)))
+                return -EFAULT;
+            mutex_lock(&dev->read_mutex);
+            if(audio_buffer_consumer_busy(dev)){
+                mutex_unlock(&dev->read_mutex);
+                return -EBUSY;
+            }
+            //Broadcast readers release only their own cursor
+            if(dev->flags & AUDIO_BUFFER_FLAG_BROADCAST){
+                cursor = broadcast_cursor(dev, client);
+                if(count > READ_ONCE(dev->head) - cursor){
+                    mutex_unlock(&dev->read_mutex);
+                    return -EINVAL;
+                }
+                broadcast_advance(dev, client, cursor, count);
+                mutex_unlock(&dev->read_mutex);
+                audio_stats_io(dev->stats, AUDIO_STATS_READ, count, READ_ONCE(dev->head) - cursor - count);
+                wake_writers(dev);
+                break;
+            }
+            if(count > audio_buffer_used(dev)){
+                mutex_unlock(&dev->read_mutex);
+                return -EINVAL;
+            }
+            audio_buffer_publish_tail(dev, dev->tail + count);
+            mutex_unlock(&dev->read_mutex);
+            audio_stats_io(dev->stats, AUDIO_STATS_READ, count, audio_buffer_used(dev));
+            wake_writers(dev);
+            break;
+        case AUDIO_BUFFER_IOCTL_SET_PERIOD:
+            //Sets this open file's wakeup and transfer granularity
+            if(copy_from_user(&count, (size_t __user *)arg, sizeof(size_t)))
+                return -EFAULT;
+            if(count == 0 || count > dev->buffer_size)
+                return -EINVAL;
+            WRITE_ONCE(client->period, count);
+            update_wake_marks(dev);
+            //A smaller period may already be satisfied
+            wake_readers(dev);
+            wake_writers(dev);
+            break;
+        case AUDIO_BUFFER_IOCTL_GET_PERIOD:
+            count = READ_ONCE(client->period);
+            if(copy_to_user((size_t __user *)arg, &count, sizeof(size_t)))
+                return -EFAULT;
+            break;
+        case AUDIO_BUFFER_IOCTL_GET_STATUS:
+            //Lets readers find out how much audio overwrite mode threw away
+            memset(&status, 0, sizeof(status));
+            status.queued = audio_buffer_used(dev);
+            status.dropped_frames = READ_ONCE(dev->dropped_frames);
+            status.new_drops = status.dropped_frames - client->drops_seen;
+            status.flags = READ_ONCE(dev->flags);
+            if(copy_to_user((struct audio_buffer_status __user *)arg, &status, sizeof(status)))
+                return -EFAULT;
+            client->drops_seen = status.dropped_frames;
+            break;
+        case AUDIO_BUFFER_IOCTL_SET_READER:
+            if(copy_from_user(&flags, (unsigned int __user *)arg, sizeof(flags)))
+                return -EFAULT;
+            if(flags & ~AUDIO_BUFFER_READER_LOSSY)
+                return -EINVAL;
+            mutex_lock(&dev->read_mutex);
+            spin_lock(&dev->clients_lock);
+            //A reader that stops being lossy first catches up with tail
+            if(dev->flags & AUDIO_BUFFER_FLAG_BROADCAST)
+                broadcast_cursor(dev, client);
+            client->reader_flags = flags;
+            if(dev->flags & AUDIO_BUFFER_FLAG_BROADCAST)
+                broadcast_update_tail(dev);
+            spin_unlock(&dev->clients_lock);
+            mutex_unlock(&dev->read_mutex);
+            wake_writers(dev);
+            break;
+        case AUDIO_BUFFER_IOCTL_GET_READER:
+            memset(&reader, 0, sizeof(reader));
+            if(READ_ONCE(dev->flags) & AUDIO_BUFFER_FLAG_BROADCAST)
+                reader.queued = min_t(size_t, READ_ONCE(dev->head) - READ_ONCE(client->cursor),
+                                      dev->buffer_size);
+            else
+                reader.queued = audio_buffer_used(dev);
+            reader.overruns = READ_ONCE(client->overruns);
+            reader.skipped_frames = READ_ONCE(client->skipped_frames);
+            reader.flags = READ_ONCE(client->reader_flags);
+            if(copy_to_user((struct audio_buffer_reader_status __user *)arg, &reader, sizeof(reader)))
+                return -EFAULT;
+            break;
+        case AUDIO_BUFFER_IOCTL_SET_GAIN:
+            if(copy_from_user(&gain, (__u32 __user *)arg, sizeof(gain)))
+                return -EFAULT;
+            if(gain > AUDIO_BUFFER_GAIN_MAX)
+                return -EINVAL;
+            WRITE_ONCE(client->gain, gain);
+            break;
+        case AUDIO_BUFFER_IOCTL_GET_GAIN:
+            gain = READ_ONCE(client->gain);
+            if(copy_to_user((__u32 __user *)arg, &gain, sizeof(gain)))
+                return -EFAULT;
+            break;
+        case AUDIO_BUFFER_IOCTL_GET_POSITION:
+            get_position(dev, &position);
+            if(copy_to_user((struct audio_buffer_position __user *)arg, &position, sizeof(position)))
+                return -EFAULT;
+            break;
+        case AUDIO_BUFFER_IOCTL_SET_CLOCK:
+            if(copy_from_user(&clock, (struct audio_buffer_clock __user *)arg, sizeof(clock)))
+                return -EFAULT;
+            lock_both_sides(dev);
+            if(clock.enable && ((dev->flags & (AUDIO_BUFFER_FLAG_OVERWRITE | AUDIO_BUFFER_FLAG_BROADCAST)) ||
+                                audio_buffer_consumer_busy(dev))){
+                unlock_both_sides(dev);
+                return -EBUSY;
+            }
+            ret = audio_clock_configure(dev, &clock);
+            unlock_both_sides(dev);
+            if(ret)
+                return ret;
+            break;
+        case AUDIO_BUFFER_IOCTL_GET_CLOCK:
+            audio_clock_get_status(dev, &clock_status);
+            if(copy_to_user((struct audio_buffer_clock_status __user *)arg, &clock_status, sizeof(clock_status)))
+                return -EFAULT;
+            break;
+        case AUDIO_BUFFER_IOCTL_GET_FLAGS:
+            flags = READ_ONCE(dev->flags);
+            if(copy_to_user((unsigned int __user *)arg, &flags, sizeof(flags)))
+                return -EFAULT;
+            break;
+        case AUDIO_BUFFER_IOCTL_SET_FLAGS:
+            if(copy_from_user(&flags, (unsigned int __user *)arg, sizeof(flags)))
+                return -EFAULT;
+            if(flags & ~AUDIO_BUFFER_FLAGS_ALL)
+                return -EINVAL;
+            //Dropping frames would race with MPSC reservations
+            if((flags & AUDIO_BUFFER_FLAG_MPSC) && (flags & AUDIO_BUFFER_FLAG_OVERWRITE))
+                return -EINVAL;
+            //Broadcast readers choose to be lossy themselves, and tail must
+            //only move under clients_lock
+            if((flags & AUDIO_BUFFER_FLAG_BROADCAST) &&
+               (flags & (AUDIO_BUFFER_FLAG_MPSC | AUDIO_BUFFER_FLAG_OVERWRITE)))
+                return -EINVAL;
+            //The mixer is the only producer
+            if((flags & AUDIO_BUFFER_FLAG_MIX) &&
+               (flags & (AUDIO_BUFFER_FLAG_MPSC | AUDIO_BUFFER_FLAG_OVERWRITE)))
+                return -EINVAL;
+            //Readers either all get the stream or share it out
+            if((flags & AUDIO_BUFFER_FLAG_BROADCAST) && (flags & AUDIO_BUFFER_FLAG_WORKQUEUE))
+                return -EINVAL;
+            //No writer of either kind is running while both sides are locked
+            lock_both_sides(dev);
+            //Overwrite and broadcast mode move tail, which the running clock owns
+            if((flags & (AUDIO_BUFFER_FLAG_OVERWRITE | AUDIO_BUFFER_FLAG_BROADCAST)) &&
+               audio_buffer_consumer_busy(dev)){
+                unlock_both_sides(dev);
+                return -EBUSY;
+            }
+            if((flags & AUDIO_BUFFER_FLAG_MIX) && audio_buffer_producer_busy(dev)){
+                unlock_both_sides(dev);
+                return -EBUSY;
+            }
+            if((flags & AUDIO_BUFFER_FLAG_MIX) && audio_mixer_enable(dev)){
+                unlock_both_sides(dev);
+                return -ENOMEM;
+            }
+            //Audio queued for the mixer does not carry over between modes
+            if((flags ^ dev->flags) & AUDIO_BUFFER_FLAG_MIX)
+                audio_mixer_reset(dev);
+            dev->reserve = dev->head;
+            //Every reader starts from what is queued now
+            if((flags & AUDIO_BUFFER_FLAG_BROADCAST) && !(dev->flags & AUDIO_BUFFER_FLAG_BROADCAST))
+                broadcast_reset_cursors(dev, dev->tail);
+            changed = flags ^ dev->flags;
+            WRITE_ONCE(dev->flags, flags);
+            unlock_both_sides(dev);
+            //The new mode may leave writers more room
+            wake_writers(dev);
+            //Exclusive waiters re-check the mode, all of them at once
+            if(changed & AUDIO_BUFFER_FLAG_WORKQUEUE)
+                wake_up_interruptible_all(&dev->read_queue);
+            audio_buffer_dbg("Device %u flags set to 0x%x\n", dev->minor, flags);
+            break;
+        case AUDIO_BUFFER_IOCTL_SET_JITTER:
+            if(copy_from_user(&jitter, (struct audio_buffer_jitter __user *)arg, sizeof(jitter)))
+                return -EFAULT;
+            lock_both_sides(dev);
+            ret = audio_jitter_configure(dev, &jitter);
+            unlock_both_sides(dev);
+            if(ret)
+                return ret;
+            //Readers held back by the old target may be free to go
+            wake_readers(dev);
+            break;
+        case AUDIO_BUFFER_IOCTL_GET_JITTER:
+            audio_jitter_get_status(dev, &jitter_status);
+            if(copy_to_user((struct audio_buffer_jitter_status __user *)arg, &jitter_status, sizeof(jitter_status)))
+                return -EFAULT;
+            break;
+        case AUDIO_BUFFER_IOCTL_SET_FORMAT:
+            //Sets the sample format this open file reads in
+            if(copy_from_user(&format, (struct audio_buffer_format __user *)arg, sizeof(format)))
+                return -EFAULT;
+            if((format.flags & ~AUDIO_BUFFER_FORMAT_MAP) || format.reserved)
+                return -EINVAL;
+            memset(&conv, 0, sizeof(conv));
+            if(format.channels && audio_convert_setup(&conv, &format))
+                return -EINVAL;
+            conv_buf = NULL;
+            if(conv.frame_bytes && !conv.copy && !client->conv_buf){
+                conv_buf = kmalloc(AUDIO_BUFFER_CONVERT_BOUNCE, GFP_KERNEL);
+                if(!conv_buf)
+                    return -ENOMEM;
+            }
+            //Reads convert under read_mutex, so none is part way through a frame
+            mutex_lock(&dev->read_mutex);
+            if(!client->conv_buf){
+                client->conv_buf = conv_buf;
+                conv_buf = NULL;
+            }
+            client->format = format;
+            client->conv = conv;
+            mutex_unlock(&dev->read_mutex);
+            kfree(conv_buf);
+            //Sleeping readers re-check against their new read period
+            wake_readers(dev);
+            break;
+        case AUDIO_BUFFER_IOCTL_GET_FORMAT:
+            mutex_lock(&dev->read_mutex);
+            format = client->format;
+            mutex_unlock(&dev->read_mutex);
+            if(copy_to_user((struct audio_buffer_format __user *)arg, &format, sizeof(format)))
+                return -EFAULT;
+            break;
+        default:
+            return -ENOTTY;
+        
+    }
+    return 0;
+}
+
+// A mapping outlives close(), so each one keeps the ring allocated itself.
+// The file (or the mapping this one was copied from) already holds a
+// reference, so the ring is there and only the counts need raising. Both go
+// up under ring_mutex, which ring_resize holds while it checks mmap_count.
+static void mmap_get_locked(struct audio_buffer_dev *dev)
+{
+    dev->ring_users++;
+    atomic_inc(&dev->mmap_count);
+}
+
+static void device_vm_open(struct vm_area_struct *vma)
+{
+    struct audio_buffer_dev *dev = vma->vm_private_data;
+
+    mutex_lock(&dev->ring_mutex);
+    mmap_get_locked(dev);
+    mutex_unlock(&dev->ring_mutex);
+}
+
+static void device_vm_close(struct vm_area_struct *vma)
+{
+    struct audio_buffer_dev *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->mmap_count);
+    audio_buffer_put_ring(dev);
+}
+
+// Hand out the control page or the ring page backing the faulting address
+static vm_fault_t device_vm_fault(struct vm_fault *vmf)
+{
+    struct audio_buffer_dev *dev = vmf->vma->vm_private_data;
+    unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+    struct page *page;
+
+    if (offset < AUDIO_BUFFER_MMAP_DATA_OFFSET) {
+        if (offset != AUDIO_BUFFER_MMAP_CTRL_OFFSET)
+            return VM_FAULT_SIGBUS;
+        page = virt_to_page(dev->ctrl);
+    } else {
+        offset -= AUDIO_BUFFER_MMAP_DATA_OFFSET;
+        if (offset >= dev->buffer_size)
+            return VM_FAULT_SIGBUS;
+        page = vmalloc_to_page(dev->buffer + offset);
+    }
+
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct device_vm_ops = {
+    .open = device_vm_open,
+    .close = device_vm_close,
+    .fault = device_vm_fault,
+};
+
+static int device_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+    struct audio_buffer_client *client = filep->private_data;
+    struct audio_buffer_dev *dev = client->dev;
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int ret = 0;
+
+    // The size checked here must still be the ring's once the mapping counts
+    mutex_lock(&dev->ring_mutex);
+    if (offset == AUDIO_BUFFER_MMAP_CTRL_OFFSET) {
+        // The control page is owned by the driver
+        if (size > PAGE_SIZE || (vma->vm_flags & VM_WRITE))
+            ret = -EINVAL;
+        else
+            vm_flags_clear(vma, VM_MAYWRITE);
+    } else if (offset == AUDIO_BUFFER_MMAP_DATA_OFFSET) {
+        if (size > PAGE_ALIGN(dev->buffer_size))
+            ret = -EINVAL;
+    } else {
+        ret = -EINVAL;
+    }
+
+    if (!ret) {
+        vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+        vma->vm_ops = &device_vm_ops;
+        vma->vm_private_data = dev;
+        mmap_get_locked(dev);
+    }
+    mutex_unlock(&dev->ring_mutex);
+    return ret;
+}
+
+
+#if IS_ENABLED(CONFIG_AUDIO_BUFFER_KUNIT_TEST)
+#include "audio_buffer_test.c"
+#endif
 
 module_init(audio_buffer_init);
 module_exit(audio_buffer_exit);
@@ -4,21 +4,284 @@
 #include <linux/mutex.h>
 #include <linux/cdev.h>
 #include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/rwsem.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/jump_label.h>
+#include <linux/seqlock.h>
+#include <linux/preempt.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+#include "audio_buffer_ioctl.h"
+#include "audio_ring.h"
+#include "audio_stats.h"
+#include "audio_clock.h"
+#include "audio_alsa.h"
+#include "audio_mixer.h"
+#include "audio_jitter.h"
+#include "audio_convert.h"
+
+#define SAMPLE_RATE 44100
+#define CHANNELS    2
+#define FRAME_BYTES 4  // 16-bit stereo = 4 bytes per frame
+
+#define AUDIO_BUFFER_MARKS 256  // Write boundaries remembered for delay queries
+
+// When the bytes from index onward were written
+struct audio_buffer_mark {
+    unsigned long index;  // head before the write
+    u64 ns;               // CLOCK_MONOTONIC time of the write
+};
 
 // Audio buffer structure
+//
+// head and tail are free-running byte counters; the byte at index i lives at
+// buffer[i & buffer_mask] and head - tail is the amount of queued data.
+// buffer_size is always a power of two so the wrap is a mask, not a division.
+// The producer only writes head and the consumer only writes tail, so a single
+// reader and a single writer never contend with each other. Each side keeps its
+// own mutex, which only serializes a second reader or writer on that side.
+//
+// In AUDIO_BUFFER_FLAG_MPSC mode writers skip write_mutex: each one claims a
+// frame-aligned region by advancing reserve with a cmpxchg, fills it, and then
+// moves head past it once all earlier regions are published. config_rwsem is
+// held shared by those writers and exclusively by mode changes, reset and resize.
+//
+// In AUDIO_BUFFER_FLAG_OVERWRITE mode a writer that finds the ring full tries
+// read_mutex as well and advances tail by whole frames, so live sources never
+// block. If a reader holds it, the writer takes whatever space there is; only
+// with none at all does it wait for that reader's copy (or return -EAGAIN if
+// nonblocking). Dropped frames are counted in dropped_frames.
+//
+// In AUDIO_BUFFER_FLAG_BROADCAST mode every reader has its own cursor and
+// tail is the cursor of the slowest reader that may not lose data, so the
+// audio is stored once and read by all of them. Lossy readers do not hold
+// tail back; when the writer overtakes one it is skipped forward instead. With
+// no such reader left the writer never waits and drops the oldest data.
+//
+// In AUDIO_BUFFER_FLAG_WORKQUEUE mode the readers are a worker pool sharing
+// the stream: each read takes one period of whole frames, and sleeping readers
+// wait exclusively, so a write wakes one of them per period it completed
+// instead of all of them.
+//
+// The ring is allocated by its first user (an open file, the ALSA front end or
+// an in-kernel client) and freed again idle_free_ms after the last one goes,
+// if nothing is left queued, so idle streams only cost their bookkeeping.
 struct audio_buffer_dev {
-    unsigned char *buffer;         // Kernel buffer for audio data
-    size_t buffer_size;            // Size of the buffer
-    size_t read_pos;               // Current read position
-    size_t write_pos;              // Current write position
-    size_t data_size;              // Amount of data currently in buffer
+    unsigned char *buffer;         // Kernel buffer for audio data (vmalloc_user), NULL while idle
+    size_t buffer_size;            // Size of the buffer, a power of two
+    size_t buffer_mask;            // buffer_size - 1
     bool is_playing;               // Flag to indicate if audio is playing
     wait_queue_head_t read_queue;  // Queue for processes waiting to read
     wait_queue_head_t write_queue; // Queue for processes waiting to write
-    struct mutex buffer_mutex;     // Mutex for buffer access
+    struct fasync_struct *async_queue; // SIGIO subscribers
+    struct audio_buffer_stats __percpu *stats; // Lock-free I/O statistics, see audio_stats.h
+    struct list_head clients;      // Open files on this device
+    spinlock_t clients_lock;       // Protects clients and clients_blocked
+    bool clients_blocked;          // Opens fail with -EBUSY, e.g. during a stress run
+    size_t read_wake;              // Smallest reader period; readers are woken at this fill level
+    size_t write_wake;             // Smallest writer period; writers are woken at this much space
     struct cdev cdev;              // Character device structure
+    unsigned int minor;            // Index N of /dev/audio_bufferN
+    struct audio_buffer_mmap_ctrl *ctrl; // Control page shared with mmap clients
+    atomic_t mmap_count;           // Number of live mappings of the device
+    unsigned int flags;            // AUDIO_BUFFER_FLAG_* mode bits
+    struct rw_semaphore config_rwsem; // Excludes mode changes from MPSC writers
+    wait_queue_head_t commit_queue; // MPSC writers waiting to publish in order
+    struct audio_clock clock;      // Optional hrtimer consumer, see audio_clock.h
+    struct audio_alsa alsa;        // Optional sound card over the ring, see audio_alsa.h
+    struct audio_mixer mixer;      // Writer inputs in mixer mode, see audio_mixer.h
+    struct audio_jitter jitter;    // Optional start threshold for readers, see audio_jitter.h
+    struct mutex ring_mutex;       // Serializes allocating, freeing, resizing and mapping buffer
+    unsigned int ring_users;       // References from audio_buffer_get_ring
+    struct delayed_work idle_work; // Frees buffer once the last user is gone
+
+    // Producer side
+    struct mutex write_mutex ____cacheline_aligned_in_smp; // Serializes writers
+    unsigned long head;            // Total bytes written
+    unsigned long reserve;         // Total bytes claimed by MPSC writers
+    bool kernel_producer;          // An in-kernel producer owns head, see audio_buffer_attach
+    seqcount_t pos_seq;            // Covers head and marks for position queries
+    unsigned long nr_marks;        // Marks recorded so far; the newest is nr_marks - 1
+    struct audio_buffer_mark marks[AUDIO_BUFFER_MARKS];
+
+    // Consumer side
+    struct mutex read_mutex ____cacheline_aligned_in_smp;  // Serializes readers
+    unsigned long tail;            // Total bytes read (by the slowest broadcast reader)
+    unsigned int blocking_readers; // Broadcast readers that are not lossy
+    bool kernel_consumer;          // An in-kernel consumer owns tail, see audio_buffer_attach
+    u64 dropped_frames;            // Frames discarded by overwrite mode
+};
+
+// State for one open file of a device
+struct audio_buffer_client {
+    struct audio_buffer_dev *dev;  // Device this file was opened on
+    struct list_head node;         // Entry in dev->clients
+    fmode_t mode;                  // FMODE_READ/FMODE_WRITE of the open
+    size_t period;                 // Wakeup and transfer granularity in bytes
+    u64 drops_seen;                // dropped_frames at the last GET_STATUS
+    unsigned int reader_flags;     // AUDIO_BUFFER_READER_* options
+    unsigned long cursor;          // Broadcast mode: total bytes this file has read
+    u64 overruns;                  // Broadcast mode: times this file was skipped forward
+    u64 skipped_frames;            // Frames it missed that way
+    u32 gain;                      // Mixer mode: Q16 gain applied to this file's writes
+    struct audio_mixer_input *input; // Mixer mode: this file's queue, once it has written
+    struct audio_buffer_format format; // Read format as set, for GET_FORMAT
+    struct audio_convert conv;     // Read conversion; frame_bytes 0 reads raw bytes
+    unsigned char *conv_buf;       // AUDIO_BUFFER_CONVERT_BOUNCE bytes, once a converting format is set
 };
 
+// Converted audio is staged in chunks this size, small enough to stay in L1
+// between the conversion and the copy to userspace
+#define AUDIO_BUFFER_CONVERT_BOUNCE 4096
+
 extern struct audio_buffer_dev *audio_device;
 
+// Debug logging, toggled with the debug module parameter. When it is off the
+// check is a patched-out jump, so it is safe to use on the data path.
+DECLARE_STATIC_KEY_FALSE(audio_buffer_debug);
+#define audio_buffer_dbg(fmt, ...)                                      \
+    do {                                                                \
+        if (static_branch_unlikely(&audio_buffer_debug))                \
+            printk(KERN_INFO "Audio Buffer: " fmt, ##__VA_ARGS__);     \
+    } while (0)
+
+// Stream devices are created at load time or via /sys/class/audio/nr_devices
+// and are never removed while the module is loaded
+unsigned int audio_buffer_device_count(void);
+struct audio_buffer_dev *audio_buffer_get_device(unsigned int minor);
+
+// Wake readers or writers whose period is satisfied; callable from any
+// context, including the clock's hrtimer and ALSA callbacks
+void audio_buffer_wake_readers(struct audio_buffer_dev *dev);
+void audio_buffer_wake_writers(struct audio_buffer_dev *dev);
+
+// Allocate the ring if needed and keep it until the matching put; every
+// user of dev->buffer holds a reference. May sleep.
+int audio_buffer_get_ring(struct audio_buffer_dev *dev);
+void audio_buffer_put_ring(struct audio_buffer_dev *dev);
+
+// Bytes of ring memory currently allocated
+static inline size_t audio_buffer_resident(struct audio_buffer_dev *dev)
+{
+    return READ_ONCE(dev->buffer) ? READ_ONCE(dev->buffer_size) : 0;
+}
+
+// Space a producer holding write_mutex may fill now, after dropping old data
+// in modes that allow it
+size_t audio_buffer_make_room(struct audio_buffer_dev *dev, size_t want);
+
+// Empty the ring and move head and tail to a multiple of buffer_size
+unsigned long audio_buffer_reset_aligned(struct audio_buffer_dev *dev);
+int audio_buffer_alsa_claim(struct audio_buffer_dev *dev, bool capture, unsigned long *base);
+void audio_buffer_alsa_release(struct audio_buffer_dev *dev);
+
+// In-kernel producers and consumers (a capture driver, a network receiver)
+// move audio straight in and out of the ring with no user copy. A client
+// first attaches to one end of a device (a producer not in mixer mode, a
+// consumer not in overwrite or broadcast mode), which makes it the only owner
+// of that end: file I/O on that end gets -EBUSY, and SET_SIZE and RESET are
+// refused until it detaches. The ALSA front end cannot be used meanwhile.
+//
+// An acquire returns up to bytes of whole frames as one or two contiguous
+// pieces, the second starting at the ring base after the wrap. The client
+// fills or consumes any prefix of them and then commits or releases that many
+// bytes, which publishes them and wakes the other end. Attach and detach may
+// sleep; acquire, commit and release take no locks and may be called from
+// softirq and hrtimer callbacks, as long as the client never runs two of them
+// for the same end at once.
+enum audio_buffer_end {
+    AUDIO_BUFFER_PRODUCER,
+    AUDIO_BUFFER_CONSUMER,
+};
+
+struct audio_buffer_region {
+    unsigned char *data[2];
+    size_t len[2];  // len[1] is 0 unless the region wraps
+};
+
+int audio_buffer_attach(struct audio_buffer_dev *dev, enum audio_buffer_end end);
+void audio_buffer_detach(struct audio_buffer_dev *dev, enum audio_buffer_end end);
+size_t audio_buffer_write_acquire(struct audio_buffer_dev *dev, size_t bytes,
+                                  struct audio_buffer_region *region);
+int audio_buffer_write_commit(struct audio_buffer_dev *dev, size_t bytes);
+size_t audio_buffer_read_acquire(struct audio_buffer_dev *dev, size_t bytes,
+                                 struct audio_buffer_region *region);
+int audio_buffer_read_release(struct audio_buffer_dev *dev, size_t bytes);
+
+// tail belongs to the virtual clock, a prepared ALSA capture stream or an
+// in-kernel consumer. Owners are only ever added with both sides locked, so
+// a reader sees any that can touch tail once it holds read_mutex.
+static inline bool audio_buffer_consumer_busy(struct audio_buffer_dev *dev)
+{
+    return READ_ONCE(dev->clock.running) || READ_ONCE(dev->kernel_consumer) ||
+           (READ_ONCE(dev->alsa.owned) && dev->alsa.capture);
+}
+
+// head belongs to a prepared ALSA playback stream or an in-kernel producer;
+// writers re-check once they hold write_mutex or config_rwsem
+static inline bool audio_buffer_producer_busy(struct audio_buffer_dev *dev)
+{
+    return READ_ONCE(dev->kernel_producer) ||
+           (READ_ONCE(dev->alsa.owned) && !dev->alsa.capture);
+}
+
+// Either end is owned by an in-kernel client
+static inline bool audio_buffer_kernel_attached(struct audio_buffer_dev *dev)
+{
+    return READ_ONCE(dev->kernel_producer) || READ_ONCE(dev->kernel_consumer);
+}
+
+// Bytes currently queued; safe to call from either side without a lock
+static inline size_t audio_buffer_used(struct audio_buffer_dev *dev)
+{
+    unsigned long tail = smp_load_acquire(&dev->tail);
+
+    return audio_ring_used(smp_load_acquire(&dev->head), tail);
+}
+
+// Bytes the jitter buffer wants queued before the consumer starts, never more
+// than half the ring so a full ring always satisfies it
+static inline size_t audio_buffer_jitter_hold(struct audio_buffer_dev *dev)
+{
+    return min(audio_jitter_hold(&dev->jitter), dev->buffer_size / 2);
+}
+
+// Publish data written up to head (call with write_mutex held)
+static inline void audio_buffer_publish_head(struct audio_buffer_dev *dev, unsigned long head)
+{
+    smp_store_release(&dev->head, head);
+    smp_store_release(&dev->ctrl->head, head);
+}
+
+// Timestamp bytes written from head onward and publish them. Only one
+// producer publishes at a time (write_mutex, or MPSC commit order), which is
+// all the seqcount needs.
+static inline void audio_buffer_publish_write(struct audio_buffer_dev *dev,
+                                              unsigned long head, size_t bytes)
+{
+    struct audio_buffer_mark *mark = &dev->marks[dev->nr_marks & (AUDIO_BUFFER_MARKS - 1)];
+    u64 now = ktime_get_ns();
+
+    preempt_disable();
+    write_seqcount_begin(&dev->pos_seq);
+    mark->index = head;
+    mark->ns = now;
+    dev->nr_marks++;
+    audio_buffer_publish_head(dev, head + bytes);
+    write_seqcount_end(&dev->pos_seq);
+    preempt_enable();
+
+    if (READ_ONCE(dev->jitter.enabled))
+        audio_jitter_write(dev, now, bytes);
+}
+
+// Release space read up to tail (call with read_mutex held)
+static inline void audio_buffer_publish_tail(struct audio_buffer_dev *dev, unsigned long tail)
+{
+    smp_store_release(&dev->tail, tail);
+    smp_store_release(&dev->ctrl->tail, tail);
+}
+
 #endif 
@@ -0,0 +1,178 @@
+#ifndef AUDIO_BUFFER_IOCTL_H
+#define AUDIO_BUFFER_IOCTL_H
+
+// Interface shared between the kernel module and userspace clients
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#ifndef __KERNEL__
+#include <stddef.h>
+#endif
+
+// Define ioctl commands
+#define AUDIO_BUFFER_IOCTL_MAGIC 'a'
+#define AUDIO_BUFFER_IOCTL_RESET _IO(AUDIO_BUFFER_IOCTL_MAGIC, 0)
+#define AUDIO_BUFFER_IOCTL_GET_SIZE _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 1, size_t)
+#define AUDIO_BUFFER_IOCTL_SET_SIZE _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 2, size_t)
+// Advance head/tail after producing/consuming bytes through the mmap
+#define AUDIO_BUFFER_IOCTL_COMMIT_WRITE _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 3, size_t)
+#define AUDIO_BUFFER_IOCTL_COMMIT_READ _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 4, size_t)
+// Read or change the device mode flags below
+#define AUDIO_BUFFER_IOCTL_GET_FLAGS _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 5, unsigned int)
+#define AUDIO_BUFFER_IOCTL_SET_FLAGS _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 6, unsigned int)
+// Per-open period in bytes: reads/writes and poll wait for a whole period,
+// and the other side is only woken once a period is available
+#define AUDIO_BUFFER_IOCTL_SET_PERIOD _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 7, size_t)
+#define AUDIO_BUFFER_IOCTL_GET_PERIOD _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 8, size_t)
+// Snapshot of the device state, including audio dropped by overwrite mode
+#define AUDIO_BUFFER_IOCTL_GET_STATUS _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 9, struct audio_buffer_status)
+// Consistent snapshot of the stream position and queue delay, for A/V sync
+#define AUDIO_BUFFER_IOCTL_GET_POSITION _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 10, struct audio_buffer_position)
+// Start or stop the hrtimer-paced virtual playback clock and read its counters
+#define AUDIO_BUFFER_IOCTL_SET_CLOCK _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 11, struct audio_buffer_clock)
+#define AUDIO_BUFFER_IOCTL_GET_CLOCK _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 12, struct audio_buffer_clock_status)
+// Per-open reader options (AUDIO_BUFFER_READER_*) and cursor state for broadcast mode
+#define AUDIO_BUFFER_IOCTL_SET_READER _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 13, unsigned int)
+#define AUDIO_BUFFER_IOCTL_GET_READER _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 14, struct audio_buffer_reader_status)
+// Per-open mixer gain in Q16 fixed point (AUDIO_BUFFER_GAIN_UNITY is 1.0)
+#define AUDIO_BUFFER_IOCTL_SET_GAIN _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 15, __u32)
+#define AUDIO_BUFFER_IOCTL_GET_GAIN _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 16, __u32)
+// Adaptive jitter buffer: start threshold and its tuning from write jitter
+#define AUDIO_BUFFER_IOCTL_SET_JITTER _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 17, struct audio_buffer_jitter)
+#define AUDIO_BUFFER_IOCTL_GET_JITTER _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 18, struct audio_buffer_jitter_status)
+// Per-open sample format for reads; see struct audio_buffer_format
+#define AUDIO_BUFFER_IOCTL_SET_FORMAT _IOW(AUDIO_BUFFER_IOCTL_MAGIC, 19, struct audio_buffer_format)
+#define AUDIO_BUFFER_IOCTL_GET_FORMAT _IOR(AUDIO_BUFFER_IOCTL_MAGIC, 20, struct audio_buffer_format)
+
+// Device mode flags
+#define AUDIO_BUFFER_FLAG_MPSC (1u << 0)  // Lock-free frame-aligned multi-writer mode
+#define AUDIO_BUFFER_FLAG_OVERWRITE (1u << 1)  // Writes never wait; the oldest frames are dropped
+#define AUDIO_BUFFER_FLAG_BROADCAST (1u << 2)  // Every reader gets the whole stream
+#define AUDIO_BUFFER_FLAG_MIX (1u << 3)  // Writers are summed, not appended
+#define AUDIO_BUFFER_FLAG_WORKQUEUE (1u << 4)  // Each read takes one period; one reader woken per period
+#define AUDIO_BUFFER_FLAGS_ALL (AUDIO_BUFFER_FLAG_MPSC | AUDIO_BUFFER_FLAG_OVERWRITE | \
+                                AUDIO_BUFFER_FLAG_BROADCAST | AUDIO_BUFFER_FLAG_MIX | \
+                                AUDIO_BUFFER_FLAG_WORKQUEUE)
+
+// Mixer gains
+#define AUDIO_BUFFER_GAIN_UNITY 0x10000u
+#define AUDIO_BUFFER_GAIN_MAX (4 * AUDIO_BUFFER_GAIN_UNITY)
+
+// Read formats. The stream itself is always S16_LE stereo at 44100 Hz.
+#define AUDIO_BUFFER_FORMAT_S16_LE 0
+#define AUDIO_BUFFER_FORMAT_S32_LE 1
+#define AUDIO_BUFFER_FORMAT_FLOAT_LE 2  // IEEE 754 single, full scale is [-1.0, 1.0)
+#define AUDIO_BUFFER_FORMAT_MAP (1u << 0)  // audio_buffer_format.map is given
+#define AUDIO_BUFFER_MAX_CHANNELS 8
+// Sources in a channel map besides the stream's channels 0 (left) and 1 (right)
+#define AUDIO_BUFFER_CHANNEL_MIX 0xfe     // Average of left and right
+#define AUDIO_BUFFER_CHANNEL_SILENT 0xff
+
+// Reader options
+#define AUDIO_BUFFER_READER_LOSSY (1u << 0)  // Broadcast: skip ahead instead of holding writers back
+
+// mmap offsets: the control page is read-only, the ring is read/write
+#define AUDIO_BUFFER_MMAP_CTRL_OFFSET 0x0
+#define AUDIO_BUFFER_MMAP_DATA_OFFSET 0x100000
+
+// Layout of the shared control page. head and tail are free-running byte
+// counters: head - tail bytes are queued, starting at tail % buffer_size.
+// Each field sits in its own 128-byte block, so the producer's and consumer's
+// stores never share a cache line (or the line pair x86 prefetches together).
+#define AUDIO_BUFFER_CTRL_STRIDE 128
+struct audio_buffer_mmap_ctrl {
+    __u64 buffer_size;  // Size of the mapped ring
+    __u8 pad0[AUDIO_BUFFER_CTRL_STRIDE - sizeof(__u64)];
+    __u64 head;         // Total bytes committed by producers
+    __u8 pad1[AUDIO_BUFFER_CTRL_STRIDE - sizeof(__u64)];
+    __u64 tail;         // Total bytes released by consumers
+    __u8 pad2[AUDIO_BUFFER_CTRL_STRIDE - sizeof(__u64)];
+};
+
+// Returned by AUDIO_BUFFER_IOCTL_GET_STATUS
+struct audio_buffer_status {
+    __u64 queued;          // Bytes currently queued
+    __u64 dropped_frames;  // Frames overwritten since the device was created
+    __u64 new_drops;       // Frames overwritten since this file last asked
+    __u32 flags;           // Current AUDIO_BUFFER_FLAG_* mode bits
+    __u32 reserved;
+};
+
+// Returned by AUDIO_BUFFER_IOCTL_GET_POSITION. All fields describe the same
+// instant. The queue delay is now_ns - oldest_ns.
+struct audio_buffer_position {
+    __u64 frames_queued;   // Frames written but not yet read
+    __u64 frames_written;  // Frames produced since the device was created
+    __u64 frames_read;     // Frames consumed (or dropped) since the device was created
+    __u64 oldest_ns;       // CLOCK_MONOTONIC time the oldest queued frame was written, 0 if empty
+    __u64 now_ns;          // CLOCK_MONOTONIC time of the snapshot
+};
+
+// Virtual playback clock settings. While enabled the driver consumes
+// rate frames per second of the stream (16-bit stereo) and read() returns
+// -EBUSY. Zero fields select the defaults shown.
+struct audio_buffer_clock {
+    __u32 enable;     // 1 to start (or restart) the clock, 0 to stop it
+    __u32 rate;       // Frames per second (44100)
+    __u32 channels;   // 16-bit samples per frame (2, the only value accepted)
+    __u32 period_us;  // Tick interval in microseconds (10000)
+};
+
+// Returned by AUDIO_BUFFER_IOCTL_GET_CLOCK; counters restart with SET_CLOCK
+struct audio_buffer_clock_status {
+    struct audio_buffer_clock config;
+    __u64 frames_consumed;  // Frames drained from the ring
+    __u64 underrun_frames;  // Frames that came due while the ring was empty
+    __u64 ticks;            // Timer callbacks
+    __u64 missed_ticks;     // Ticks skipped because the timer ran late
+    __s64 last_drift_ns;    // How late the last tick fired
+    __s64 max_drift_ns;     // Latest any tick has fired
+};
+
+// Jitter buffer settings. While enabled, reads (and the virtual clock) wait
+// until the target fill is queued before they start, and again after every
+// time the ring runs dry. The target is the write gap that is exceeded with
+// probability underrun_ppm, as play time, kept within [min_us, max_us] and
+// half the ring. Zero fields select the defaults shown.
+struct audio_buffer_jitter {
+    __u32 enable;        // 1 to enable (resetting the statistics), 0 to disable
+    __u32 underrun_ppm;  // Accepted chance per write that the ring runs dry (1000 = 0.1%)
+    __u32 min_us;        // Lowest target latency (5000)
+    __u32 max_us;        // Highest target latency (200000)
+};
+
+// Returned by AUDIO_BUFFER_IOCTL_GET_JITTER
+struct audio_buffer_jitter_status {
+    struct audio_buffer_jitter config;
+    __u64 target_bytes;  // Fill that reads currently wait for before starting
+    __u32 target_us;     // The same as play time
+    __u32 jitter_us;     // Smoothed deviation of write gaps from the audio they carried
+    __u64 writes;        // Writes measured since enabled
+    __u64 underruns;     // Times the ring ran dry after reading had started
+    __u32 primed;        // 1 while reads run freely, 0 while waiting for the target
+    __u32 reserved;
+};
+
+// Read format of one open file. With channels 0 (the default) reads return
+// the stream's raw bytes. Otherwise every read returns whole frames of
+// channels samples in format, converted while they are copied out of the ring.
+// Without AUDIO_BUFFER_FORMAT_MAP, one channel is the downmix of both, two are
+// left and right, and further channels are silent.
+struct audio_buffer_format {
+    __u32 format;    // AUDIO_BUFFER_FORMAT_*
+    __u32 channels;  // 0 for raw bytes, else 1..AUDIO_BUFFER_MAX_CHANNELS
+    __u32 flags;     // AUDIO_BUFFER_FORMAT_MAP
+    __u8 map[AUDIO_BUFFER_MAX_CHANNELS];  // Source of each output channel: 0, 1 or AUDIO_BUFFER_CHANNEL_*
+    __u32 reserved;
+};
+
+// Returned by AUDIO_BUFFER_IOCTL_GET_READER
+struct audio_buffer_reader_status {
+    __u64 queued;          // Bytes this file has not read yet
+    __u64 overruns;        // Times a lossy reader was skipped forward
+    __u64 skipped_frames;  // Frames it missed as a result
+    __u32 flags;           // AUDIO_BUFFER_READER_* options
+    __u32 reserved;
+};
+
+#endif /* AUDIO_BUFFER_IOCTL_H */
@@ -0,0 +1,374 @@
+// KUnit suite for the stream devices. It is #included at the end of
+// audio_buffer.c when CONFIG_AUDIO_BUFFER_KUNIT_TEST is set, so it drives the
+// same static open/read/write/reset/resize paths the file operations use,
+// through kernel iterators instead of a user process. Run it under UML with
+//   ./tools/testing/kunit/kunit.py run --kunitconfig=<this directory>
+// once the directory is wired into the tree (see README.md).
+//
+// Every case runs against audio_buffer0 and is skipped if anything else is
+// using it. The ring is emptied and its size restored afterwards.
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/uio.h>
+
+#define TEST_RING_SIZE 4096
+
+struct audio_test {
+    struct audio_buffer_dev *dev;
+    size_t saved_size;
+};
+
+struct audio_test_file {
+    struct inode inode;
+    struct file file;
+};
+
+static struct file *test_open(struct kunit *test, fmode_t mode)
+{
+    struct audio_test *ctx = test->priv;
+    struct audio_test_file *tf;
+
+    tf = kunit_kzalloc(test, sizeof(*tf), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, tf);
+    tf->inode.i_cdev = &ctx->dev->cdev;
+    tf->file.f_inode = &tf->inode;
+    tf->file.f_mode = mode;
+    KUNIT_ASSERT_EQ(test, device_open(&tf->inode, &tf->file), 0);
+    return &tf->file;
+}
+
+static void test_close(struct file *file)
+{
+    device_release(file->f_inode, file);
+}
+
+// One nonblocking read or write of len bytes at buf, as read(2)/write(2) would
+static ssize_t test_io(struct file *file, void *buf, size_t len, bool write)
+{
+    struct kvec kvec = { .iov_base = buf, .iov_len = len };
+    struct iov_iter iter;
+    struct kiocb kiocb;
+
+    init_sync_kiocb(&kiocb, file);
+    kiocb.ki_flags |= IOCB_NOWAIT;
+    iov_iter_kvec(&iter, write ? ITER_SOURCE : ITER_DEST, &kvec, 1, len);
+    return write ? device_write_iter(&kiocb, &iter) : device_read_iter(&kiocb, &iter);
+}
+
+static void fill_pattern(unsigned char *buf, size_t len, unsigned int seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (unsigned char)(seed + i * 7);
+}
+
+static void audio_test_ring_span(struct kunit *test)
+{
+    struct audio_ring_span span;
+
+    span = audio_ring_span(TEST_RING_SIZE, 3 * TEST_RING_SIZE + 100, 200);
+    KUNIT_EXPECT_EQ(test, span.pos, (size_t)100);
+    KUNIT_EXPECT_EQ(test, span.first, (size_t)200);
+    KUNIT_EXPECT_EQ(test, span.second, (size_t)0);
+
+    span = audio_ring_span(TEST_RING_SIZE, TEST_RING_SIZE - 96, 200);
+    KUNIT_EXPECT_EQ(test, span.pos, (size_t)(TEST_RING_SIZE - 96));
+    KUNIT_EXPECT_EQ(test, span.first, (size_t)96);
+    KUNIT_EXPECT_EQ(test, span.second, (size_t)104);
+
+    // Free-running indices wrap the unsigned long as well as the ring
+    span = audio_ring_span(TEST_RING_SIZE, ULONG_MAX - 3, 8);
+    KUNIT_EXPECT_EQ(test, span.first, (size_t)4);
+    KUNIT_EXPECT_EQ(test, span.second, (size_t)4);
+}
+
+// Data written across the end of the ring comes back intact and in order
+static void audio_test_wraparound(struct kunit *test)
+{
+    struct audio_test *ctx = test->priv;
+    struct file *writer, *reader;
+    unsigned char *in, *out;
+    unsigned int round;
+    size_t len = 3000;
+
+    in = kunit_kzalloc(test, len, GFP_KERNEL);
+    out = kunit_kzalloc(test, len, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    writer = test_open(test, FMODE_WRITE);
+    reader = test_open(test, FMODE_READ);
+
+    // 3000-byte transfers through a 4096-byte ring split at the wrap point
+    // on most rounds, each time at a different offset
+    for (round = 0; round < 8; round++) {
+        fill_pattern(in, len, round);
+        memset(out, 0, len);
+        KUNIT_EXPECT_EQ(test, test_io(writer, in, len, true), (ssize_t)len);
+        KUNIT_EXPECT_EQ(test, audio_buffer_used(ctx->dev), len);
+        KUNIT_EXPECT_EQ(test, test_io(reader, out, len, false), (ssize_t)len);
+        KUNIT_EXPECT_MEMEQ(test, in, out, len);
+        KUNIT_EXPECT_EQ(test, audio_buffer_used(ctx->dev), (size_t)0);
+    }
+
+    test_close(reader);
+    test_close(writer);
+}
+
+// An empty ring turns readers away and a full one writers, then they recover
+static void audio_test_full_empty(struct kunit *test)
+{
+    struct audio_test *ctx = test->priv;
+    struct audio_buffer_dev *dev = ctx->dev;
+    struct file *writer, *reader;
+    unsigned char *buf;
+    size_t size = dev->buffer_size;
+
+    buf = kunit_kzalloc(test, size, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    writer = test_open(test, FMODE_WRITE);
+    reader = test_open(test, FMODE_READ);
+
+    KUNIT_EXPECT_EQ(test, test_io(reader, buf, 4, false), (ssize_t)-EAGAIN);
+
+    fill_pattern(buf, size, 1);
+    KUNIT_EXPECT_EQ(test, test_io(writer, buf, size, true), (ssize_t)size);
+    KUNIT_EXPECT_EQ(test, audio_buffer_used(dev), size);
+    KUNIT_EXPECT_EQ(test, test_io(writer, buf, 4, true), (ssize_t)-EAGAIN);
+
+    // Freeing a little lets exactly that much in again
+    KUNIT_EXPECT_EQ(test, test_io(reader, buf, 64, false), (ssize_t)64);
+    KUNIT_EXPECT_EQ(test, test_io(writer, buf, size, true), (ssize_t)64);
+    KUNIT_EXPECT_EQ(test, audio_buffer_used(dev), size);
+
+    KUNIT_EXPECT_EQ(test, test_io(reader, buf, size, false), (ssize_t)size);
+    KUNIT_EXPECT_EQ(test, audio_buffer_used(dev), (size_t)0);
+    KUNIT_EXPECT_EQ(test, test_io(reader, buf, 4, false), (ssize_t)-EAGAIN);
+
+    test_close(reader);
+    test_close(writer);
+}
+
+// Frames carry a sequence number and its complement, so a reader can tell a
+// torn or reordered frame from audio that a reset legitimately dropped
+struct audio_test_stream {
+    struct file *file;
+    u32 seq;
+    u64 frames;
+    atomic_t torn;
+    atomic_t reordered;
+};
+
+#define TEST_STREAM_FRAMES 64
+
+static int test_producer(void *arg)
+{
+    struct audio_test_stream *stream = arg;
+    u32 frames[TEST_STREAM_FRAMES];
+    ssize_t ret;
+    int i;
+
+    while (!kthread_should_stop()) {
+        for (i = 0; i < TEST_STREAM_FRAMES; i++)
+            frames[i] = (u16)(stream->seq + i) | (u32)(u16)~(stream->seq + i) << 16;
+        ret = test_io(stream->file, frames, sizeof(frames), true);
+        if (ret > 0) {
+            // Writes and reads stay frame-aligned, so this is whole frames
+            stream->seq += ret / FRAME_BYTES;
+            stream->frames += ret / FRAME_BYTES;
+        } else {
+            usleep_range(50, 100);
+        }
+    }
+    return 0;
+}
+
+static int test_consumer(void *arg)
+{
+    struct audio_test_stream *stream = arg;
+    u32 frames[TEST_STREAM_FRAMES];
+    bool first = true;
+    u16 last = 0;
+    ssize_t ret;
+    u16 seq;
+    int i;
+
+    while (!kthread_should_stop()) {
+        ret = test_io(stream->file, frames, sizeof(frames), false);
+        if (ret <= 0) {
+            usleep_range(50, 100);
+            continue;
+        }
+        for (i = 0; i < ret / FRAME_BYTES; i++) {
+            seq = (u16)frames[i];
+            if ((u16)(frames[i] >> 16) != (u16)~seq)
+                atomic_inc(&stream->torn);
+            // A reset may skip ahead, but never back
+            else if (!first && (u16)(seq - last - 1) >= 0x8000)
+                atomic_inc(&stream->reordered);
+            last = seq;
+            first = false;
+        }
+        stream->frames += ret / FRAME_BYTES;
+    }
+    return 0;
+}
+
+// SET_SIZE and RESET while a writer and a reader keep the ring busy
+static void audio_test_resize_reset_io(struct kunit *test)
+{
+    static const size_t sizes[] = { 4096, 65536, 1024, 16384 };
+    struct audio_test *ctx = test->priv;
+    struct audio_test_stream *in, *out;
+    struct task_struct *producer, *consumer;
+    int ret;
+    int i;
+
+    in = kunit_kzalloc(test, sizeof(*in), GFP_KERNEL);
+    out = kunit_kzalloc(test, sizeof(*out), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    in->file = test_open(test, FMODE_WRITE);
+    out->file = test_open(test, FMODE_READ);
+
+    producer = kthread_run(test_producer, in, "audio_test/w");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(producer));
+    consumer = kthread_run(test_consumer, out, "audio_test/r");
+    if (IS_ERR(consumer)) {
+        kthread_stop(producer);
+        KUNIT_FAIL(test, "cannot start the consumer thread");
+        return;
+    }
+
+    for (i = 0; i < 64; i++) {
+        // Shrinking below what is queued is refused, not lossy
+        ret = ring_resize(ctx->dev, sizes[i % ARRAY_SIZE(sizes)]);
+        KUNIT_EXPECT_TRUE(test, ret == 0 || ret == -EBUSY);
+        usleep_range(500, 1000);
+        if (i % 4 == 3)
+            KUNIT_EXPECT_EQ(test, ring_reset(ctx->dev), 0);
+        usleep_range(500, 1000);
+    }
+
+    kthread_stop(consumer);
+    kthread_stop(producer);
+
+    KUNIT_EXPECT_EQ(test, atomic_read(&out->torn), 0);
+    KUNIT_EXPECT_EQ(test, atomic_read(&out->reordered), 0);
+    KUNIT_EXPECT_GT(test, out->frames, 0ULL);
+    KUNIT_EXPECT_LE(test, out->frames, in->frames);
+
+    test_close(out->file);
+    test_close(in->file);
+}
+
+// The value of "key: N" in the first device section of /proc/my_stats
+static u64 proc_value(struct kunit *test, const char *key)
+{
+    struct seq_file m = { };
+    unsigned long long value = 0;
+    const char *p;
+
+    m.size = 16 * PAGE_SIZE;
+    m.buf = kunit_kzalloc(test, m.size, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, m.buf);
+    KUNIT_ASSERT_EQ(test, my_proc_show(&m, NULL), 0);
+    KUNIT_ASSERT_FALSE(test, seq_has_overflowed(&m));
+    m.buf[min(m.count, m.size - 1)] = '\0';
+
+    p = strstr(m.buf, "\naudio_buffer0:\n");
+    KUNIT_ASSERT_NOT_NULL(test, p);
+    p = strstr(p, key);
+    KUNIT_ASSERT_NOT_NULL(test, p);
+    KUNIT_ASSERT_EQ(test, sscanf(p + strlen(key), ": %llu", &value), 1);
+    kunit_kfree(test, m.buf);
+    return value;
+}
+
+// Transfers show up in the /proc/my_stats counters
+static void audio_test_proc_stats(struct kunit *test)
+{
+    struct file *writer, *reader;
+    u64 write_bytes, write_calls, read_bytes, read_eagain;
+    unsigned char buf[400];
+
+    writer = test_open(test, FMODE_WRITE);
+    reader = test_open(test, FMODE_READ);
+
+    write_bytes = proc_value(test, "Write Bytes");
+    write_calls = proc_value(test, "Write Calls");
+    read_bytes = proc_value(test, "Read Bytes");
+    read_eagain = proc_value(test, "Read EAGAIN");
+    KUNIT_EXPECT_EQ(test, proc_value(test, "Current Buffer Usage"), 0ULL);
+
+    fill_pattern(buf, sizeof(buf), 3);
+    KUNIT_EXPECT_EQ(test, test_io(writer, buf, sizeof(buf), true), (ssize_t)sizeof(buf));
+    KUNIT_EXPECT_EQ(test, proc_value(test, "Current Buffer Usage"), (u64)sizeof(buf));
+    KUNIT_EXPECT_EQ(test, proc_value(test, "Write Bytes"), write_bytes + sizeof(buf));
+    KUNIT_EXPECT_EQ(test, proc_value(test, "Write Calls"), write_calls + 1);
+
+    KUNIT_EXPECT_EQ(test, test_io(reader, buf, sizeof(buf), false), (ssize_t)sizeof(buf));
+    KUNIT_EXPECT_EQ(test, test_io(reader, buf, sizeof(buf), false), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, proc_value(test, "Current Buffer Usage"), 0ULL);
+    KUNIT_EXPECT_EQ(test, proc_value(test, "Read Bytes"), read_bytes + sizeof(buf));
+    KUNIT_EXPECT_EQ(test, proc_value(test, "Read EAGAIN"), read_eagain + 1);
+
+    test_close(reader);
+    test_close(writer);
+}
+
+static int audio_test_init(struct kunit *test)
+{
+    struct audio_buffer_dev *dev = audio_buffer_get_device(0);
+    struct audio_test *ctx;
+
+    if (!dev)
+        kunit_skip(test, "no audio_buffer0");
+    if (READ_ONCE(dev->flags) || !list_empty(&dev->clients) ||
+        audio_buffer_consumer_busy(dev) || audio_buffer_producer_busy(dev) ||
+        atomic_read(&dev->mmap_count))
+        kunit_skip(test, "audio_buffer0 is in use");
+
+    ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx);
+    ctx->dev = dev;
+    ctx->saved_size = dev->buffer_size;
+
+    // The ring may have been freed while idle; keep it for the whole case
+    KUNIT_ASSERT_EQ(test, audio_buffer_get_ring(dev), 0);
+    test->priv = ctx;
+    KUNIT_ASSERT_EQ(test, ring_reset(dev), 0);
+    KUNIT_ASSERT_EQ(test, ring_resize(dev, TEST_RING_SIZE), 0);
+    return 0;
+}
+
+static void audio_test_exit(struct kunit *test)
+{
+    struct audio_test *ctx = test->priv;
+
+    if (!ctx)
+        return;
+    ring_reset(ctx->dev);
+    ring_resize(ctx->dev, ctx->saved_size);
+    audio_buffer_put_ring(ctx->dev);
+}
+
+static struct kunit_case audio_buffer_test_cases[] = {
+    KUNIT_CASE(audio_test_ring_span),
+    KUNIT_CASE(audio_test_wraparound),
+    KUNIT_CASE(audio_test_full_empty),
+    KUNIT_CASE(audio_test_resize_reset_io),
+    KUNIT_CASE(audio_test_proc_stats),
+    {}
+};
+
+static struct kunit_suite audio_buffer_test_suite = {
+    .name = "audio_buffer",
+    .init = audio_test_init,
+    .exit = audio_test_exit,
+    .test_cases = audio_buffer_test_cases,
+};
+
+kunit_test_suite(audio_buffer_test_suite);
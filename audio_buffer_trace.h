@@ -0,0 +1,189 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM audio_buffer
+
+#if !defined(AUDIO_BUFFER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define AUDIO_BUFFER_TRACE_H
+
+// Tracepoints for the data path. Enable them with
+// echo 1 > /sys/kernel/tracing/events/audio_buffer/enable
+// or record them with perf record -e 'audio_buffer:*'.
+// ts is CLOCK_MONOTONIC in ns so events can be lined up with userspace clocks.
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+// A completed read or write: pos is the ring offset the copy started at and
+// fill is how many bytes are queued afterwards
+DECLARE_EVENT_CLASS(audio_buffer_io,
+    TP_PROTO(unsigned int minor, unsigned long pos, size_t bytes,
+             size_t fill, size_t size),
+    TP_ARGS(minor, pos, bytes, fill, size),
+
+    TP_STRUCT__entry(
+        __field(u64, ts)
+        __field(unsigned int, minor)
+        __field(unsigned long, pos)
+        __field(size_t, bytes)
+        __field(size_t, fill)
+        __field(size_t, size)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_get_ns();
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->bytes = bytes;
+        __entry->fill = fill;
+        __entry->size = size;
+    ),
+
+    TP_printk("dev=%u ts=%llu pos=%lu bytes=%zu fill=%zu/%zu",
+              __entry->minor, __entry->ts, __entry->pos, __entry->bytes,
+              __entry->fill, __entry->size)
+);
+
+DEFINE_EVENT(audio_buffer_io, audio_buffer_read,
+    TP_PROTO(unsigned int minor, unsigned long pos, size_t bytes,
+             size_t fill, size_t size),
+    TP_ARGS(minor, pos, bytes, fill, size));
+
+DEFINE_EVENT(audio_buffer_io, audio_buffer_write,
+    TP_PROTO(unsigned int minor, unsigned long pos, size_t bytes,
+             size_t fill, size_t size),
+    TP_ARGS(minor, pos, bytes, fill, size));
+
+// A reader or writer about to sleep (or fail with -EAGAIN) until want bytes
+// of data or space are available
+TRACE_EVENT(audio_buffer_wait,
+    TP_PROTO(unsigned int minor, bool writer, size_t want, size_t fill),
+    TP_ARGS(minor, writer, want, fill),
+
+    TP_STRUCT__entry(
+        __field(u64, ts)
+        __field(unsigned int, minor)
+        __field(bool, writer)
+        __field(size_t, want)
+        __field(size_t, fill)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_get_ns();
+        __entry->minor = minor;
+        __entry->writer = writer;
+        __entry->want = want;
+        __entry->fill = fill;
+    ),
+
+    TP_printk("dev=%u ts=%llu %s want=%zu fill=%zu",
+              __entry->minor, __entry->ts,
+              __entry->writer ? "writer" : "reader",
+              __entry->want, __entry->fill)
+);
+
+// Readers or writers being woken because their watermark was reached
+TRACE_EVENT(audio_buffer_wake,
+    TP_PROTO(unsigned int minor, bool writers, size_t fill),
+    TP_ARGS(minor, writers, fill),
+
+    TP_STRUCT__entry(
+        __field(u64, ts)
+        __field(unsigned int, minor)
+        __field(bool, writers)
+        __field(size_t, fill)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_get_ns();
+        __entry->minor = minor;
+        __entry->writers = writers;
+        __entry->fill = fill;
+    ),
+
+    TP_printk("dev=%u ts=%llu %s fill=%zu",
+              __entry->minor, __entry->ts,
+              __entry->writers ? "writers" : "readers", __entry->fill)
+);
+
+// A writer found the ring full (overrun) or a reader found it empty (underrun)
+DECLARE_EVENT_CLASS(audio_buffer_xrun,
+    TP_PROTO(unsigned int minor, unsigned long head, unsigned long tail),
+    TP_ARGS(minor, head, tail),
+
+    TP_STRUCT__entry(
+        __field(u64, ts)
+        __field(unsigned int, minor)
+        __field(unsigned long, head)
+        __field(unsigned long, tail)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_get_ns();
+        __entry->minor = minor;
+        __entry->head = head;
+        __entry->tail = tail;
+    ),
+
+    TP_printk("dev=%u ts=%llu head=%lu tail=%lu",
+              __entry->minor, __entry->ts, __entry->head, __entry->tail)
+);
+
+DEFINE_EVENT(audio_buffer_xrun, audio_buffer_overrun,
+    TP_PROTO(unsigned int minor, unsigned long head, unsigned long tail),
+    TP_ARGS(minor, head, tail));
+
+DEFINE_EVENT(audio_buffer_xrun, audio_buffer_underrun,
+    TP_PROTO(unsigned int minor, unsigned long head, unsigned long tail),
+    TP_ARGS(minor, head, tail));
+
+// RESET dropped the queued bytes
+TRACE_EVENT(audio_buffer_reset,
+    TP_PROTO(unsigned int minor, size_t dropped),
+    TP_ARGS(minor, dropped),
+
+    TP_STRUCT__entry(
+        __field(u64, ts)
+        __field(unsigned int, minor)
+        __field(size_t, dropped)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_get_ns();
+        __entry->minor = minor;
+        __entry->dropped = dropped;
+    ),
+
+    TP_printk("dev=%u ts=%llu dropped=%zu",
+              __entry->minor, __entry->ts, __entry->dropped)
+);
+
+// SET_SIZE replaced the ring
+TRACE_EVENT(audio_buffer_resize,
+    TP_PROTO(unsigned int minor, size_t old_size, size_t new_size),
+    TP_ARGS(minor, old_size, new_size),
+
+    TP_STRUCT__entry(
+        __field(u64, ts)
+        __field(unsigned int, minor)
+        __field(size_t, old_size)
+        __field(size_t, new_size)
+    ),
+
+    TP_fast_assign(
+        __entry->ts = ktime_get_ns();
+        __entry->minor = minor;
+        __entry->old_size = old_size;
+        __entry->new_size = new_size;
+    ),
+
+    TP_printk("dev=%u ts=%llu size=%zu->%zu",
+              __entry->minor, __entry->ts, __entry->old_size, __entry->new_size)
+);
+
+#endif /* AUDIO_BUFFER_TRACE_H */
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE audio_buffer_trace
+#include <trace/define_trace.h>
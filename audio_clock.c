@@ -0,0 +1,154 @@
+#include <linux/kernel.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/version.h>
+#include "audio_buffer.h"
+#include "audio_clock.h"
+#include "audio_buffer_trace.h"
+
+#define CLOCK_DEFAULT_RATE      SAMPLE_RATE
+#define CLOCK_DEFAULT_CHANNELS  CHANNELS
+#define CLOCK_DEFAULT_PERIOD_US 10000  // 10 ms
+#define CLOCK_MAX_RATE          768000
+#define CLOCK_MIN_PERIOD_US     100
+
+// One tick: consume every frame that has come due since the clock started.
+// Working from elapsed time rather than a fixed amount per tick keeps the
+// long-run rate exact even when ticks fire late or are skipped.
+static enum hrtimer_restart audio_clock_tick(struct hrtimer *timer)
+{
+    struct audio_clock *clock = container_of(timer, struct audio_clock, timer);
+    struct audio_buffer_dev *dev = container_of(clock, struct audio_buffer_dev, clock);
+    ktime_t now = hrtimer_cb_get_time(timer);
+    s64 drift = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+    u64 due, want, have, frames, overruns;
+    size_t used, bytes;
+    unsigned long tail;
+
+    due = mul_u64_u32_div(ktime_to_ns(ktime_sub(now, clock->start)),
+                          clock->config.rate, NSEC_PER_SEC);
+    want = due - clock->frames_done;
+    used = audio_buffer_used(dev);
+    // Until the jitter buffer has its target queued the device plays silence
+    have = used < audio_buffer_jitter_hold(dev) ? 0 : used / FRAME_BYTES;
+    frames = min(want, have);
+    if (have)
+        audio_jitter_consume(&dev->jitter, used);
+
+    if (frames) {
+        bytes = frames * FRAME_BYTES;
+        tail = dev->tail;
+        audio_buffer_publish_tail(dev, tail + bytes);
+        trace_audio_buffer_read(dev->minor, tail & dev->buffer_mask, bytes,
+                                used - bytes, dev->buffer_size);
+    }
+
+    // The virtual device plays silence for frames the ring did not have
+    if (want > frames) {
+        audio_jitter_consume(&dev->jitter, 0);
+        WRITE_ONCE(clock->underrun_frames, clock->underrun_frames + want - frames);
+        trace_audio_buffer_underrun(dev->minor, READ_ONCE(dev->head), dev->tail);
+    }
+
+    clock->frames_done = due;
+    WRITE_ONCE(clock->frames_consumed, clock->frames_consumed + frames);
+    WRITE_ONCE(clock->ticks, clock->ticks + 1);
+    WRITE_ONCE(clock->last_drift_ns, drift);
+    if (drift > clock->max_drift_ns)
+        WRITE_ONCE(clock->max_drift_ns, drift);
+
+    overruns = hrtimer_forward(timer, now, clock->period);
+    if (overruns > 1)
+        WRITE_ONCE(clock->missed_ticks, clock->missed_ticks + overruns - 1);
+
+    if (frames)
+        audio_buffer_wake_writers(dev);
+
+    return HRTIMER_RESTART;
+}
+
+void audio_clock_init(struct audio_buffer_dev *dev)
+{
+    struct audio_clock *clock = &dev->clock;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&clock->timer, audio_clock_tick, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+    hrtimer_init(&clock->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    clock->timer.function = audio_clock_tick;
+#endif
+    clock->config.rate = CLOCK_DEFAULT_RATE;
+    clock->config.channels = CLOCK_DEFAULT_CHANNELS;
+    clock->config.period_us = CLOCK_DEFAULT_PERIOD_US;
+}
+
+// Start, retune or stop the clock. Called with both sides locked, so the
+// timer is already paused; audio_clock_resume restarts it if running.
+int audio_clock_configure(struct audio_buffer_dev *dev, const struct audio_buffer_clock *config)
+{
+    struct audio_clock *clock = &dev->clock;
+    struct audio_buffer_clock cfg = *config;
+    ktime_t now;
+
+    if (!cfg.enable) {
+        WRITE_ONCE(clock->running, false);
+        return 0;
+    }
+
+    if (!cfg.rate)
+        cfg.rate = CLOCK_DEFAULT_RATE;
+    if (!cfg.channels)
+        cfg.channels = CLOCK_DEFAULT_CHANNELS;
+    if (!cfg.period_us)
+        cfg.period_us = CLOCK_DEFAULT_PERIOD_US;
+    // The clock consumes the ring's own frames, whose format is fixed
+    if (cfg.rate > CLOCK_MAX_RATE || cfg.channels != CHANNELS ||
+        cfg.period_us < CLOCK_MIN_PERIOD_US)
+        return -EINVAL;
+
+    // Counters restart with every configuration
+    now = ktime_get();
+    clock->config = cfg;
+    clock->period = us_to_ktime(cfg.period_us);
+    clock->start = now;
+    clock->frames_done = 0;
+    clock->frames_consumed = 0;
+    clock->underrun_frames = 0;
+    clock->ticks = 0;
+    clock->missed_ticks = 0;
+    clock->last_drift_ns = 0;
+    clock->max_drift_ns = 0;
+    hrtimer_set_expires(&clock->timer, ktime_add(now, clock->period));
+    WRITE_ONCE(clock->running, true);
+    return 0;
+}
+
+void audio_clock_get_status(struct audio_buffer_dev *dev, struct audio_buffer_clock_status *status)
+{
+    struct audio_clock *clock = &dev->clock;
+
+    memset(status, 0, sizeof(*status));
+    status->config = clock->config;
+    status->config.enable = READ_ONCE(clock->running);
+    status->frames_consumed = READ_ONCE(clock->frames_consumed);
+    status->underrun_frames = READ_ONCE(clock->underrun_frames);
+    status->ticks = READ_ONCE(clock->ticks);
+    status->missed_ticks = READ_ONCE(clock->missed_ticks);
+    status->last_drift_ns = READ_ONCE(clock->last_drift_ns);
+    status->max_drift_ns = READ_ONCE(clock->max_drift_ns);
+}
+
+void audio_clock_pause(struct audio_buffer_dev *dev)
+{
+    hrtimer_cancel(&dev->clock.timer);
+}
+
+// Restart at the next tick that was already scheduled. Time spent paused is
+// still owed, so the first tick catches up on it (or counts it as underrun).
+void audio_clock_resume(struct audio_buffer_dev *dev)
+{
+    if (READ_ONCE(dev->clock.running))
+        hrtimer_start(&dev->clock.timer, hrtimer_get_expires(&dev->clock.timer),
+                      HRTIMER_MODE_ABS);
+}
@@ -0,0 +1,39 @@
+#ifndef AUDIO_CLOCK_H
+#define AUDIO_CLOCK_H
+
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include "audio_buffer_ioctl.h"
+
+struct audio_buffer_dev;
+
+// Virtual playback clock. While running, an hrtimer drains the ring at
+// rate * FRAME_BYTES per second as if a sound card were consuming it, so the
+// device becomes a rate-controlled sink. The timer is the only consumer:
+// readers get -EBUSY, and it is paused whenever both sides of the ring are
+// locked. All fields except running are written only by the timer callback
+// or with the timer stopped.
+struct audio_clock {
+    struct hrtimer timer;
+    bool running;                 // Set by SET_CLOCK with both sides locked
+    struct audio_buffer_clock config;
+    ktime_t period;               // Tick interval
+    ktime_t start;                // Time frame 0 was due
+    u64 frames_done;              // Frames consumed plus frames missed
+    u64 frames_consumed;
+    u64 underrun_frames;
+    u64 ticks;
+    u64 missed_ticks;
+    s64 last_drift_ns;
+    s64 max_drift_ns;
+};
+
+void audio_clock_init(struct audio_buffer_dev *dev);
+int audio_clock_configure(struct audio_buffer_dev *dev, const struct audio_buffer_clock *config);
+void audio_clock_get_status(struct audio_buffer_dev *dev, struct audio_buffer_clock_status *status);
+
+// Stop the timer while both sides are locked and restart it afterwards
+void audio_clock_pause(struct audio_buffer_dev *dev);
+void audio_clock_resume(struct audio_buffer_dev *dev);
+
+#endif /* AUDIO_CLOCK_H */
@@ -0,0 +1,173 @@
+#ifndef AUDIO_CONVERT_H
+#define AUDIO_CONVERT_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#include <asm/byteorder.h>
+#else
+#include "audio_host.h"
+#endif
+#include "audio_buffer_ioctl.h"
+
+// Sample conversion for readers that asked for their own format
+// (AUDIO_BUFFER_IOCTL_SET_FORMAT). The stream is S16_LE stereo; each output
+// channel is the left channel, the right one, their average or silence, and
+// is written as S16_LE, S32_LE or FLOAT_LE. Everything is integer arithmetic,
+// so it runs in the kernel without the FPU, and like audio_mix.h it can be
+// built and timed in userspace.
+//
+// A frame is loaded as one 32-bit word and each output sample is
+// (left * wl + right * wr) / 2 with weights of 0, 1 or 2 per channel, so
+// picking a channel, averaging and muting are the same branch-free sum.
+// The stream's own format (S16_LE, left and right in order) is a plain copy.
+
+struct audio_convert {
+    u32 format;                                  // AUDIO_BUFFER_FORMAT_*
+    u32 channels;                                // Output channels
+    u32 frame_bytes;                             // Output bytes per frame
+    bool copy;                                   // Output is the stream as it is
+    u8 wl[AUDIO_BUFFER_MAX_CHANNELS];            // Left weight per output channel
+    u8 wr[AUDIO_BUFFER_MAX_CHANNELS];            // Right weight
+};
+
+// Set conv up for format; returns 0, or -1 for a request it cannot serve
+static inline int audio_convert_setup(struct audio_convert *conv,
+                                      const struct audio_buffer_format *format)
+{
+    u32 sample_bytes;
+    u32 ch;
+    u8 src;
+
+    switch (format->format) {
+    case AUDIO_BUFFER_FORMAT_S16_LE:
+        sample_bytes = 2;
+        break;
+    case AUDIO_BUFFER_FORMAT_S32_LE:
+    case AUDIO_BUFFER_FORMAT_FLOAT_LE:
+        sample_bytes = 4;
+        break;
+    default:
+        return -1;
+    }
+    if (!format->channels || format->channels > AUDIO_BUFFER_MAX_CHANNELS)
+        return -1;
+
+    conv->format = format->format;
+    conv->channels = format->channels;
+    conv->frame_bytes = format->channels * sample_bytes;
+    for (ch = 0; ch < format->channels; ch++) {
+        if (format->flags & AUDIO_BUFFER_FORMAT_MAP)
+            src = format->map[ch];
+        else if (format->channels == 1)
+            src = AUDIO_BUFFER_CHANNEL_MIX;  // Mono is the downmix
+        else
+            src = ch < 2 ? ch : AUDIO_BUFFER_CHANNEL_SILENT;
+
+        switch (src) {
+        case 0:
+            conv->wl[ch] = 2;
+            conv->wr[ch] = 0;
+            break;
+        case 1:
+            conv->wl[ch] = 0;
+            conv->wr[ch] = 2;
+            break;
+        case AUDIO_BUFFER_CHANNEL_MIX:
+            conv->wl[ch] = 1;
+            conv->wr[ch] = 1;
+            break;
+        case AUDIO_BUFFER_CHANNEL_SILENT:
+            conv->wl[ch] = 0;
+            conv->wr[ch] = 0;
+            break;
+        default:
+            return -1;
+        }
+    }
+    conv->copy = conv->format == AUDIO_BUFFER_FORMAT_S16_LE && conv->channels == 2 &&
+                 conv->wl[0] == 2 && conv->wr[0] == 0 && conv->wl[1] == 0 && conv->wr[1] == 2;
+    return 0;
+}
+
+// Bits of the float v / 65536, for |v| <= 65536, built with integer ops
+static inline u32 audio_convert_float_bits(s32 v)
+{
+    u32 sign = v < 0 ? 0x80000000u : 0;
+    u32 m = v < 0 ? -v : v;
+    u32 e;
+
+    if (!m)
+        return 0;
+    e = 31 - __builtin_clz(m);
+    return sign | ((127 + e - 16) << 23) | ((m << (23 - e)) & 0x7fffff);
+}
+
+// Convert frames of stream audio at src (any alignment) into dst
+static inline void audio_convert_frames(const struct audio_convert *conv, void *dst,
+                                        const void *src, size_t frames)
+{
+    const unsigned char *in = src;
+    u32 channels = conv->channels;
+    s32 left, right, sum;
+    size_t i;
+    u32 word;
+    u32 ch;
+
+    if (conv->copy) {
+        memcpy(dst, src, frames * 4);
+        return;
+    }
+
+    switch (conv->format) {
+    case AUDIO_BUFFER_FORMAT_S16_LE: {
+        __le16 *out = dst;
+
+        for (i = 0; i < frames; i++, in += 4, out += channels) {
+            memcpy(&word, in, 4);
+            word = le32_to_cpu((__force __le32)word);
+            left = (s16)word;
+            right = (s16)(word >> 16);
+            for (ch = 0; ch < channels; ch++) {
+                sum = left * conv->wl[ch] + right * conv->wr[ch];
+                out[ch] = cpu_to_le16((u16)(sum >> 1));
+            }
+        }
+        break;
+    }
+    case AUDIO_BUFFER_FORMAT_S32_LE: {
+        __le32 *out = dst;
+
+        // Full scale is 1 << 31; an average keeps its extra half bit
+        for (i = 0; i < frames; i++, in += 4, out += channels) {
+            memcpy(&word, in, 4);
+            word = le32_to_cpu((__force __le32)word);
+            left = (s16)word;
+            right = (s16)(word >> 16);
+            for (ch = 0; ch < channels; ch++) {
+                sum = left * conv->wl[ch] + right * conv->wr[ch];
+                out[ch] = cpu_to_le32((u32)sum << 15);
+            }
+        }
+        break;
+    }
+    case AUDIO_BUFFER_FORMAT_FLOAT_LE: {
+        __le32 *out = dst;
+
+        // sum is in units of 1/65536 of full scale
+        for (i = 0; i < frames; i++, in += 4, out += channels) {
+            memcpy(&word, in, 4);
+            word = le32_to_cpu((__force __le32)word);
+            left = (s16)word;
+            right = (s16)(word >> 16);
+            for (ch = 0; ch < channels; ch++) {
+                sum = left * conv->wl[ch] + right * conv->wr[ch];
+                out[ch] = cpu_to_le32(audio_convert_float_bits(sum));
+            }
+        }
+        break;
+    }
+    }
+}
+
+#endif /* AUDIO_CONVERT_H */
@@ -0,0 +1,36 @@
+#ifndef AUDIO_HOST_H
+#define AUDIO_HOST_H
+
+// Userspace stand-ins for the few kernel definitions used by the header-only
+// cores (audio_ring.h, audio_mix.h, audio_convert.h), so host tools can build
+// them unchanged
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <linux/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define S16_MAX INT16_MAX
+#define S16_MIN INT16_MIN
+
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+
+#define clamp_t(type, v, lo, hi) min_t(type, max_t(type, v, lo), hi)
+
+#define __force
+#define le32_to_cpu(x) le32toh(x)
+#define cpu_to_le16(x) htole16(x)
+#define cpu_to_le32(x) htole32(x)
+
+#endif /* AUDIO_HOST_H */
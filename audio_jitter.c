@@ -0,0 +1,157 @@
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include "audio_buffer.h"
+#include "audio_jitter.h"
+
+#define JITTER_DEFAULT_PPM    1000    // 0.1%
+#define JITTER_DEFAULT_MIN_US 5000
+#define JITTER_DEFAULT_MAX_US 200000
+#define JITTER_MAX_US         2000000
+#define JITTER_BYTE_RATE      (SAMPLE_RATE * FRAME_BYTES)
+#define JITTER_DECAY_TOTAL    4096    // Halve the histogram once it holds this many gaps
+#define JITTER_RETUNE_MASK    15      // Recompute target every 16 writes
+
+static u64 bytes_to_ns(size_t bytes)
+{
+    return div_u64((u64)bytes * NSEC_PER_SEC, JITTER_BYTE_RATE);
+}
+
+static size_t us_to_bytes(u32 us)
+{
+    return audio_ring_frames(div_u64((u64)us * JITTER_BYTE_RATE, USEC_PER_SEC), FRAME_BYTES);
+}
+
+// Smallest gap that at most underrun_ppm of the recorded gaps exceed, as
+// bytes of play time within the configured bounds. Half the ring is the
+// ceiling so that a waiting reader can never stall a blocked writer.
+static size_t jitter_target(struct audio_buffer_dev *dev)
+{
+    struct audio_jitter *jitter = &dev->jitter;
+    u64 allowed = div_u64((u64)jitter->hist_total * jitter->config.underrun_ppm, 1000000);
+    u64 above = 0;
+    u32 us = jitter->config.max_us;
+    int bucket;
+
+    for (bucket = AUDIO_JITTER_BUCKETS - 1; bucket >= 0; bucket--) {
+        above += jitter->hist[bucket];
+        if (above > allowed) {
+            if (bucket < AUDIO_JITTER_BUCKETS - 1)
+                us = (bucket + 1) * AUDIO_JITTER_BUCKET_US;
+            break;
+        }
+    }
+    us = clamp(us, jitter->config.min_us, jitter->config.max_us);
+    return min(us_to_bytes(us), audio_ring_frames(dev->buffer_size / 2, FRAME_BYTES));
+}
+
+void audio_jitter_write(struct audio_buffer_dev *dev, u64 now, size_t bytes)
+{
+    struct audio_jitter *jitter = &dev->jitter;
+    u64 gap, deviation;
+    unsigned int bucket;
+    int i;
+
+    if (jitter->last_ns) {
+        gap = now - jitter->last_ns;
+        deviation = gap > jitter->last_play_ns ? gap - jitter->last_play_ns :
+                                                 jitter->last_play_ns - gap;
+        // The RFC 3550 interarrival jitter estimate
+        jitter->jitter_ns += ((s64)deviation - jitter->jitter_ns) / 16;
+
+        bucket = min_t(u64, div_u64(gap, AUDIO_JITTER_BUCKET_US * NSEC_PER_USEC),
+                       AUDIO_JITTER_BUCKETS - 1);
+        jitter->hist[bucket]++;
+        if (++jitter->hist_total >= JITTER_DECAY_TOTAL) {
+            jitter->hist_total = 0;
+            for (i = 0; i < AUDIO_JITTER_BUCKETS; i++) {
+                jitter->hist[i] /= 2;
+                jitter->hist_total += jitter->hist[i];
+            }
+        }
+
+        WRITE_ONCE(jitter->writes, jitter->writes + 1);
+        if (!(jitter->writes & JITTER_RETUNE_MASK))
+            WRITE_ONCE(jitter->target, jitter_target(dev));
+    }
+    jitter->last_ns = now;
+    jitter->last_play_ns = bytes_to_ns(bytes);
+}
+
+void audio_jitter_consume(struct audio_jitter *jitter, size_t queued)
+{
+    if (!READ_ONCE(jitter->enabled))
+        return;
+    if (!queued) {
+        if (jitter->primed) {
+            WRITE_ONCE(jitter->primed, false);
+            WRITE_ONCE(jitter->underruns, jitter->underruns + 1);
+        }
+    } else if (!jitter->primed && queued >= READ_ONCE(jitter->target)) {
+        WRITE_ONCE(jitter->primed, true);
+    }
+}
+
+void audio_jitter_restart(struct audio_buffer_dev *dev)
+{
+    WRITE_ONCE(dev->jitter.primed, false);
+}
+
+void audio_jitter_init(struct audio_buffer_dev *dev)
+{
+    struct audio_jitter *jitter = &dev->jitter;
+
+    jitter->config.underrun_ppm = JITTER_DEFAULT_PPM;
+    jitter->config.min_us = JITTER_DEFAULT_MIN_US;
+    jitter->config.max_us = JITTER_DEFAULT_MAX_US;
+}
+
+// Called with both sides locked, so neither end is using the state. The
+// target starts at min_us and grows as the histogram fills.
+int audio_jitter_configure(struct audio_buffer_dev *dev, const struct audio_buffer_jitter *config)
+{
+    struct audio_jitter *jitter = &dev->jitter;
+    struct audio_buffer_jitter cfg = *config;
+
+    if (!cfg.enable) {
+        WRITE_ONCE(jitter->enabled, false);
+        return 0;
+    }
+
+    if (!cfg.underrun_ppm)
+        cfg.underrun_ppm = JITTER_DEFAULT_PPM;
+    if (!cfg.min_us)
+        cfg.min_us = JITTER_DEFAULT_MIN_US;
+    if (!cfg.max_us)
+        cfg.max_us = JITTER_DEFAULT_MAX_US;
+    if (cfg.underrun_ppm > 1000000 || cfg.max_us > JITTER_MAX_US || cfg.min_us > cfg.max_us)
+        return -EINVAL;
+
+    jitter->config = cfg;
+    jitter->last_ns = 0;
+    jitter->last_play_ns = 0;
+    jitter->jitter_ns = 0;
+    memset(jitter->hist, 0, sizeof(jitter->hist));
+    jitter->hist_total = 0;
+    jitter->writes = 0;
+    jitter->underruns = 0;
+    jitter->primed = false;
+    jitter->target = min(us_to_bytes(cfg.min_us), audio_ring_frames(dev->buffer_size / 2, FRAME_BYTES));
+    WRITE_ONCE(jitter->enabled, true);
+    return 0;
+}
+
+void audio_jitter_get_status(struct audio_buffer_dev *dev, struct audio_buffer_jitter_status *status)
+{
+    struct audio_jitter *jitter = &dev->jitter;
+
+    memset(status, 0, sizeof(*status));
+    status->config = jitter->config;
+    status->config.enable = READ_ONCE(jitter->enabled);
+    status->target_bytes = READ_ONCE(jitter->target);
+    status->target_us = div_u64(status->target_bytes * USEC_PER_SEC, JITTER_BYTE_RATE);
+    status->jitter_us = div_u64(max_t(s64, READ_ONCE(jitter->jitter_ns), 0), NSEC_PER_USEC);
+    status->writes = READ_ONCE(jitter->writes);
+    status->underruns = READ_ONCE(jitter->underruns);
+    status->primed = READ_ONCE(jitter->primed);
+}
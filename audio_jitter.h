@@ -0,0 +1,66 @@
+#ifndef AUDIO_JITTER_H
+#define AUDIO_JITTER_H
+
+#include <linux/types.h>
+#include <linux/compiler.h>
+#include "audio_buffer_ioctl.h"
+
+struct audio_buffer_dev;
+
+#define AUDIO_JITTER_BUCKETS 256       // Write gap histogram, the last bucket open-ended
+#define AUDIO_JITTER_BUCKET_US 1000    // Width of each bucket
+
+// Adaptive jitter buffer (AUDIO_BUFFER_IOCTL_SET_JITTER). Reads and the
+// virtual clock hold off until target bytes are queued, then run freely
+// until they find the ring empty, which counts as an underrun and makes them
+// wait for the target again.
+//
+// Whoever publishes head records the gap since the previous write in a
+// histogram that halves itself every few thousand writes, so it follows the
+// producer's current behaviour. target is the gap exceeded by only
+// underrun_ppm of writes, as bytes of play time: enough queued audio to ride
+// out all but that fraction of the producer's stalls, and no more.
+//
+// Producer fields are written in publish order (write_mutex, MPSC commit
+// order or a single in-kernel producer); primed and underruns by the single
+// consumer holding read_mutex or owning tail; the rest with both sides locked.
+struct audio_jitter {
+    bool enabled;
+    struct audio_buffer_jitter config;
+
+    // Producer side
+    u64 last_ns;                      // When the previous write was published
+    u64 last_play_ns;                 // Play time of the audio it carried
+    s64 jitter_ns;                    // Smoothed |gap - last_play_ns|
+    u32 hist[AUDIO_JITTER_BUCKETS];   // Recent write gaps
+    u32 hist_total;
+    u64 writes;
+    size_t target;                    // Bytes to queue before reads start
+
+    // Consumer side
+    bool primed;                      // Reached target since the ring last ran dry
+    u64 underruns;
+};
+
+void audio_jitter_init(struct audio_buffer_dev *dev);
+int audio_jitter_configure(struct audio_buffer_dev *dev, const struct audio_buffer_jitter *config);
+void audio_jitter_get_status(struct audio_buffer_dev *dev, struct audio_buffer_jitter_status *status);
+
+// Wait for the target again, after a reset dropped the queued audio
+void audio_jitter_restart(struct audio_buffer_dev *dev);
+
+// bytes were just published at now (ns, CLOCK_MONOTONIC)
+void audio_jitter_write(struct audio_buffer_dev *dev, u64 now, size_t bytes);
+
+// The consumer found queued bytes in the ring; 0 means it ran dry
+void audio_jitter_consume(struct audio_jitter *jitter, size_t queued);
+
+// Bytes that must be queued before the consumer may take any
+static inline size_t audio_jitter_hold(struct audio_jitter *jitter)
+{
+    if (!READ_ONCE(jitter->enabled) || READ_ONCE(jitter->primed))
+        return 0;
+    return READ_ONCE(jitter->target);
+}
+
+#endif /* AUDIO_JITTER_H */
@@ -0,0 +1,256 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include "audio_buffer.h"
+#include "audio_mixer.h"
+#include "audio_buffer_trace.h"
+
+#define MIXER_SAMPLES (AUDIO_MIXER_CHUNK * CHANNELS)
+
+static void audio_mixer_work(struct work_struct *work)
+{
+    struct audio_mixer *mixer = container_of(work, struct audio_mixer, work);
+
+    audio_mixer_run(container_of(mixer, struct audio_buffer_dev, mixer));
+}
+
+void audio_mixer_init(struct audio_buffer_dev *dev)
+{
+    INIT_LIST_HEAD(&dev->mixer.inputs);
+    INIT_WORK(&dev->mixer.work, audio_mixer_work);
+}
+
+void audio_mixer_cleanup(struct audio_buffer_dev *dev)
+{
+    cancel_work_sync(&dev->mixer.work);
+    kfree(dev->mixer.acc);
+}
+
+int audio_mixer_enable(struct audio_buffer_dev *dev)
+{
+    // The accumulators are followed by room for the clipped samples
+    if (!dev->mixer.acc)
+        dev->mixer.acc = kmalloc_array(MIXER_SAMPLES, sizeof(s32) + sizeof(s16), GFP_KERNEL);
+    return dev->mixer.acc ? 0 : -ENOMEM;
+}
+
+// Throw away everything queued; inputs start over as if never written
+void audio_mixer_reset(struct audio_buffer_dev *dev)
+{
+    struct audio_mixer_input *input;
+
+    list_for_each_entry(input, &dev->mixer.inputs, node) {
+        smp_store_release(&input->tail, input->head);
+        input->started = false;
+    }
+    dev->mixer.stalled = false;
+}
+
+struct audio_mixer_input *audio_mixer_attach(struct audio_buffer_dev *dev,
+                                             struct audio_buffer_client *client)
+{
+    struct audio_mixer_input *input = READ_ONCE(client->input);
+
+    if (input)
+        return input;
+
+    input = kzalloc(sizeof(*input), GFP_KERNEL);
+    if (!input)
+        return ERR_PTR(-ENOMEM);
+    input->buffer = vmalloc(AUDIO_MIXER_INPUT_SIZE);
+    if (!input->buffer) {
+        kfree(input);
+        return ERR_PTR(-ENOMEM);
+    }
+    input->client = client;
+    mutex_init(&input->lock);
+
+    // Another thread writing to the same file may have got there first
+    mutex_lock(&dev->write_mutex);
+    if (client->input) {
+        mutex_unlock(&dev->write_mutex);
+        vfree(input->buffer);
+        kfree(input);
+        return client->input;
+    }
+    list_add_tail(&input->node, &dev->mixer.inputs);
+    dev->mixer.nr_inputs++;
+    WRITE_ONCE(client->input, input);
+    mutex_unlock(&dev->write_mutex);
+    return input;
+}
+
+void audio_mixer_detach(struct audio_buffer_dev *dev, struct audio_buffer_client *client)
+{
+    struct audio_mixer_input *input = client->input;
+
+    if (!input)
+        return;
+
+    mutex_lock(&dev->write_mutex);
+    list_del(&input->node);
+    dev->mixer.nr_inputs--;
+    client->input = NULL;
+    mutex_unlock(&dev->write_mutex);
+
+    vfree(input->buffer);
+    kfree(input);
+
+    // The others no longer wait for this input
+    audio_mixer_run(dev);
+}
+
+size_t audio_mixer_copy_in(struct audio_mixer_input *input, struct iov_iter *from, size_t len)
+{
+    struct audio_ring_span span = audio_ring_span(AUDIO_MIXER_INPUT_SIZE, input->head, len);
+    size_t copied;
+
+    copied = copy_from_iter(input->buffer + span.pos, span.first, from);
+    if (copied == span.first && span.second)
+        copied += copy_from_iter(input->buffer, span.second, from);
+    return copied;
+}
+
+// How long, in bytes of the others' audio, a quiet input is waited for: one
+// of its writer's periods
+static size_t mixer_hold(struct audio_mixer_input *input)
+{
+    return clamp_t(size_t, READ_ONCE(input->client->period), AUDIO_MIXER_HOLD_MIN,
+                   AUDIO_MIXER_HOLD);
+}
+
+// Frames that can be mixed now, or 0 to wait for a late input
+static size_t mixer_frames(struct audio_buffer_dev *dev)
+{
+    struct audio_mixer_input *input;
+    size_t frames = SIZE_MAX;
+    size_t backlog = 0;
+    size_t hold = SIZE_MAX;
+    size_t queued;
+
+    list_for_each_entry(input, &dev->mixer.inputs, node) {
+        queued = (smp_load_acquire(&input->head) - input->tail) / FRAME_BYTES;
+        if (!queued) {
+            if (READ_ONCE(input->started))
+                hold = min(hold, mixer_hold(input));
+            continue;
+        }
+        frames = min(frames, queued);
+        backlog = max(backlog, queued);
+    }
+
+    if (!backlog)
+        return 0;
+    // Until a period has gone by without it, a late input may still catch up
+    if (hold != SIZE_MAX && backlog * FRAME_BYTES < hold)
+        return 0;
+    return min_t(size_t, frames, AUDIO_MIXER_CHUNK);
+}
+
+// Sum frames from every input that has them into mixer.acc and release them.
+// Inputs without data were late and count the frames as underrun.
+static void mixer_sum(struct audio_buffer_dev *dev, size_t frames)
+{
+    struct audio_mixer *mixer = &dev->mixer;
+    struct audio_mixer_input *input;
+    size_t bytes = frames * FRAME_BYTES;
+    struct audio_ring_span span;
+    size_t done;
+    bool first = true;
+    bool late = false;
+    u32 gain;
+
+    list_for_each_entry(input, &mixer->inputs, node) {
+        if (smp_load_acquire(&input->head) - input->tail < bytes) {
+            if (input->started) {
+                WRITE_ONCE(input->started, false);
+                WRITE_ONCE(input->underrun_frames, input->underrun_frames + frames);
+                late = true;
+            }
+            continue;
+        }
+
+        // Whole frames are always mixed, so tail and the split are frame-aligned
+        gain = READ_ONCE(input->client->gain);
+        span = audio_ring_span(AUDIO_MIXER_INPUT_SIZE, input->tail, bytes);
+        done = span.first / sizeof(s16);
+        if (first) {
+            audio_mix_first(mixer->acc, (s16 *)(input->buffer + span.pos), done, gain);
+            audio_mix_first(mixer->acc + done, (s16 *)input->buffer,
+                            span.second / sizeof(s16), gain);
+            first = false;
+        } else {
+            audio_mix_add(mixer->acc, (s16 *)(input->buffer + span.pos), done, gain);
+            audio_mix_add(mixer->acc + done, (s16 *)input->buffer,
+                          span.second / sizeof(s16), gain);
+        }
+        smp_store_release(&input->tail, input->tail + bytes);
+    }
+
+    if (late)
+        WRITE_ONCE(mixer->underrun_frames, mixer->underrun_frames + frames);
+}
+
+// Clip the accumulators into the ring at head, splitting at the wrap point
+static void mixer_output(struct audio_buffer_dev *dev, size_t frames)
+{
+    s16 *out = (s16 *)(dev->mixer.acc + MIXER_SAMPLES);
+
+    audio_mix_clip(out, dev->mixer.acc, frames * CHANNELS);
+    audio_ring_write(dev->buffer, dev->buffer_size, dev->head, out, frames * FRAME_BYTES);
+}
+
+void audio_mixer_run(struct audio_buffer_dev *dev)
+{
+    struct audio_mixer *mixer = &dev->mixer;
+    unsigned long start;
+    size_t frames;
+    size_t space;
+    size_t total = 0;
+
+    mutex_lock(&dev->write_mutex);
+    WRITE_ONCE(mixer->stalled, false);
+    start = dev->head;
+    while ((dev->flags & AUDIO_BUFFER_FLAG_MIX) && (frames = mixer_frames(dev))) {
+        space = audio_buffer_make_room(dev, frames * FRAME_BYTES) / FRAME_BYTES;
+        WRITE_ONCE(mixer->stalled, space < frames);
+        frames = min(frames, space);
+        if (!frames)
+            break;
+
+        mixer_sum(dev, frames);
+        mixer_output(dev, frames);
+        audio_buffer_publish_write(dev, dev->head, frames * FRAME_BYTES);
+        total += frames * FRAME_BYTES;
+    }
+    if (total)
+        dev->is_playing = true;
+    mutex_unlock(&dev->write_mutex);
+
+    if (!total)
+        return;
+
+    trace_audio_buffer_write(dev->minor, start & dev->buffer_mask, total,
+                             audio_buffer_used(dev), dev->buffer_size);
+    audio_buffer_wake_readers(dev);
+
+    // Inputs have room again; writers wait on their input, not on the ring
+    if (wq_has_sleeper(&dev->write_queue))
+        wake_up_interruptible(&dev->write_queue);
+    kill_fasync(&dev->async_queue, SIGIO, POLL_OUT);
+}
+
+void audio_mixer_schedule(struct audio_buffer_dev *dev)
+{
+    schedule_work(&dev->mixer.work);
+}
+
+void audio_mixer_kick(struct audio_buffer_dev *dev)
+{
+    if (READ_ONCE(dev->mixer.stalled))
+        schedule_work(&dev->mixer.work);
+}
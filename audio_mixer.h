@@ -0,0 +1,76 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include "audio_mix.h"
+
+struct audio_buffer_dev;
+struct audio_buffer_client;
+struct iov_iter;
+
+#define AUDIO_MIXER_INPUT_SIZE (64 * 1024)  // Per-writer queue, a power of two
+#define AUDIO_MIXER_HOLD_MIN 1024  // Least backlog a late input holds back (~6 ms)
+#define AUDIO_MIXER_HOLD (AUDIO_MIXER_INPUT_SIZE / 2)  // Most backlog a late input holds back
+#define AUDIO_MIXER_CHUNK 1024  // Frames summed per pass
+
+// One writer's queue in mixer mode. head and tail are free-running like the
+// ring's; the writer owns head and the mixer owns tail.
+struct audio_mixer_input {
+    struct list_head node;              // Entry in mixer.inputs
+    struct audio_buffer_client *client; // File that writes here, for its gain
+    unsigned char *buffer;              // AUDIO_MIXER_INPUT_SIZE bytes
+    unsigned long head;                 // Total bytes queued
+    unsigned long tail;                 // Total bytes mixed
+    struct mutex lock;                  // Serializes writers sharing the file
+    bool started;                       // Wrote since it was last skipped
+    u64 underrun_frames;                // Frames mixed without this input
+};
+
+// In-kernel mixer (AUDIO_BUFFER_FLAG_MIX). Every writer queues into its own
+// input and the mixer, the ring's only producer, appends the saturated sum of
+// the inputs. It mixes as many frames as every input has queued. An input
+// that has gone quiet holds the others back for one of its periods, i.e. until
+// one of them has queued that many bytes (within AUDIO_MIXER_HOLD_MIN and
+// AUDIO_MIXER_HOLD); after that it is underrun and mixed as silence until it
+// writes again. The mixer runs in the writer after each write, and from a work
+// item when readers free space in a ring the mixer had filled. inputs and acc
+// are used with write_mutex held.
+struct audio_mixer {
+    struct list_head inputs;
+    unsigned int nr_inputs;
+    s32 *acc;                   // Accumulators, then the clipped output, for one chunk
+    struct work_struct work;
+    bool stalled;               // Input was left over because the ring was full
+    u64 underrun_frames;        // Frames mixed while some input was late
+};
+
+void audio_mixer_init(struct audio_buffer_dev *dev);
+void audio_mixer_cleanup(struct audio_buffer_dev *dev);
+
+// Called with both sides locked when the mode is set, and on reset
+int audio_mixer_enable(struct audio_buffer_dev *dev);
+void audio_mixer_reset(struct audio_buffer_dev *dev);
+
+// A file's input is created by its first mixer-mode write and freed on close
+struct audio_mixer_input *audio_mixer_attach(struct audio_buffer_dev *dev,
+                                             struct audio_buffer_client *client);
+void audio_mixer_detach(struct audio_buffer_dev *dev, struct audio_buffer_client *client);
+
+// Queue up to len bytes at the input's head; returns how many were copied.
+// Called with input->lock held.
+size_t audio_mixer_copy_in(struct audio_mixer_input *input, struct iov_iter *from, size_t len);
+
+// Mix what the inputs have queued. run sleeps on write_mutex; schedule and
+// kick are safe from any context, and kick only acts if the mixer stalled.
+void audio_mixer_run(struct audio_buffer_dev *dev);
+void audio_mixer_schedule(struct audio_buffer_dev *dev);
+void audio_mixer_kick(struct audio_buffer_dev *dev);
+
+static inline size_t audio_mixer_input_space(struct audio_mixer_input *input)
+{
+    return AUDIO_MIXER_INPUT_SIZE - (READ_ONCE(input->head) - smp_load_acquire(&input->tail));
+}
+
+#endif /* AUDIO_MIXER_H */
@@ -0,0 +1,100 @@
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/minmax.h>
+#include <linux/string.h>
+#else
+#include "audio_host.h"
+#endif
+
+// Ring arithmetic shared by the device, the mixer inputs and host tools.
+// Positions are free-running byte counters: the byte at index i lives at
+// offset i & (size - 1), head - tail bytes are queued, and size is a power of
+// two. Nothing here locks or orders memory; callers publish indices with the
+// barriers their side needs.
+
+// A region of len bytes starting at index, as one or two contiguous pieces:
+// first bytes at offset pos, then second bytes from offset 0 after the wrap
+struct audio_ring_span {
+    size_t pos;
+    size_t first;
+    size_t second;
+};
+
+static inline struct audio_ring_span audio_ring_span(size_t size, unsigned long index, size_t len)
+{
+    struct audio_ring_span span;
+
+    span.pos = index & (size - 1);
+    span.first = min_t(size_t, len, size - span.pos);
+    span.second = len - span.first;
+    return span;
+}
+
+static inline size_t audio_ring_used(unsigned long head, unsigned long tail)
+{
+    return head - tail;
+}
+
+static inline size_t audio_ring_space(size_t size, unsigned long head, unsigned long tail)
+{
+    return size - (head - tail);
+}
+
+// Largest whole number of frames in bytes
+static inline size_t audio_ring_frames(size_t bytes, size_t frame_bytes)
+{
+    return bytes - bytes % frame_bytes;
+}
+
+// Copy len bytes into the ring at index
+static inline void audio_ring_write(unsigned char *ring, size_t size, unsigned long index,
+                                    const void *src, size_t len)
+{
+    struct audio_ring_span span = audio_ring_span(size, index, len);
+
+    memcpy(ring + span.pos, src, span.first);
+    memcpy(ring, (const unsigned char *)src + span.first, span.second);
+}
+
+// Copy len bytes out of the ring from index
+static inline void audio_ring_read(const unsigned char *ring, size_t size, unsigned long index,
+                                   void *dst, size_t len)
+{
+    struct audio_ring_span span = audio_ring_span(size, index, len);
+
+    memcpy(dst, ring + span.pos, span.first);
+    memcpy((unsigned char *)dst + span.first, ring, span.second);
+}
+
+// Zero len bytes of the ring from index
+static inline void audio_ring_clear(unsigned char *ring, size_t size, unsigned long index,
+                                    size_t len)
+{
+    struct audio_ring_span span = audio_ring_span(size, index, len);
+
+    memset(ring + span.pos, 0, span.first);
+    memset(ring, 0, span.second);
+}
+
+// Copy the queued bytes [index, index + len) between two rings of different
+// sizes. Each byte keeps its free-running index, so head and tail stay valid.
+static inline void audio_ring_migrate(unsigned char *dst, size_t dst_size,
+                                      const unsigned char *src, size_t src_size,
+                                      unsigned long index, size_t len)
+{
+    size_t src_pos, dst_pos, chunk;
+
+    while (len) {
+        src_pos = index & (src_size - 1);
+        dst_pos = index & (dst_size - 1);
+        chunk = min_t(size_t, len, min_t(size_t, src_size - src_pos, dst_size - dst_pos));
+        memcpy(dst + dst_pos, src + src_pos, chunk);
+        index += chunk;
+        len -= chunk;
+    }
+}
+
+#endif /* AUDIO_RING_H */
@@ -0,0 +1,108 @@
+#ifndef AUDIO_STATS_H
+#define AUDIO_STATS_H
+
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/bitops.h>
+#include <linux/timekeeping.h>
+
+// Per-CPU I/O statistics. Each CPU only ever updates its own copy with
+// preemption disabled, so the data path takes no shared lock or cache line.
+// The per-CPU seqcount lets /proc take a consistent snapshot of each copy
+// without blocking writers.
+
+#define AUDIO_STATS_BUCKETS 32  // log2 buckets: bucket b holds [2^(b-1), 2^b)
+
+// Indexed by direction so that read and write share the helpers below
+enum audio_stats_dir {
+    AUDIO_STATS_READ,
+    AUDIO_STATS_WRITE,
+    AUDIO_STATS_DIRS,
+};
+
+enum audio_stats_counter {
+    AUDIO_STAT_BYTES,   // Bytes transferred
+    AUDIO_STAT_CALLS,   // Completed transfers
+    AUDIO_STAT_WAITS,   // Transfers that had to sleep
+    AUDIO_STAT_EAGAIN,  // Nonblocking transfers turned away
+    AUDIO_STAT_XRUNS,   // Ring found full (write) or empty (read)
+    AUDIO_STAT_COUNTERS,
+};
+
+enum audio_stats_hist {
+    AUDIO_HIST_XFER,  // Transfer size in bytes
+    AUDIO_HIST_WAIT,  // Time spent sleeping in ns
+    AUDIO_HIST_FILL,  // Bytes queued after the transfer
+    AUDIO_HISTS,
+};
+
+struct audio_buffer_stats {
+    seqcount_t seq;
+    u64 count[AUDIO_STATS_DIRS][AUDIO_STAT_COUNTERS];
+    u64 hist[AUDIO_STATS_DIRS][AUDIO_HISTS][AUDIO_STATS_BUCKETS];
+    u64 last_ns[AUDIO_STATS_DIRS];  // CLOCK_REALTIME of the last transfer
+};
+
+static inline unsigned int audio_stats_bucket(u64 value)
+{
+    return min_t(unsigned int, fls64(value), AUDIO_STATS_BUCKETS - 1);
+}
+
+// Open and close an update of this CPU's copy
+static inline struct audio_buffer_stats *audio_stats_begin(struct audio_buffer_stats __percpu *stats)
+{
+    struct audio_buffer_stats *s = get_cpu_ptr(stats);
+
+    write_seqcount_begin(&s->seq);
+    return s;
+}
+
+static inline void audio_stats_end(struct audio_buffer_stats __percpu *stats,
+                                   struct audio_buffer_stats *s)
+{
+    write_seqcount_end(&s->seq);
+    put_cpu_ptr(stats);
+}
+
+// A completed transfer of bytes leaving fill bytes queued
+static inline void audio_stats_io(struct audio_buffer_stats __percpu *stats,
+                                  enum audio_stats_dir dir, size_t bytes, size_t fill)
+{
+    struct audio_buffer_stats *s = audio_stats_begin(stats);
+
+    s->count[dir][AUDIO_STAT_BYTES] += bytes;
+    s->count[dir][AUDIO_STAT_CALLS]++;
+    s->hist[dir][AUDIO_HIST_XFER][audio_stats_bucket(bytes)]++;
+    s->hist[dir][AUDIO_HIST_FILL][audio_stats_bucket(fill)]++;
+    s->last_ns[dir] = ktime_get_real_ns();
+    audio_stats_end(stats, s);
+}
+
+// A transfer slept for ns nanoseconds
+static inline void audio_stats_wait(struct audio_buffer_stats __percpu *stats,
+                                    enum audio_stats_dir dir, u64 ns)
+{
+    struct audio_buffer_stats *s = audio_stats_begin(stats);
+
+    s->count[dir][AUDIO_STAT_WAITS]++;
+    s->hist[dir][AUDIO_HIST_WAIT][audio_stats_bucket(ns)]++;
+    audio_stats_end(stats, s);
+}
+
+static inline void audio_stats_add(struct audio_buffer_stats __percpu *stats,
+                                   enum audio_stats_dir dir, enum audio_stats_counter counter,
+                                   u64 value)
+{
+    struct audio_buffer_stats *s = audio_stats_begin(stats);
+
+    s->count[dir][counter] += value;
+    audio_stats_end(stats, s);
+}
+
+static inline void audio_stats_inc(struct audio_buffer_stats __percpu *stats,
+                                   enum audio_stats_dir dir, enum audio_stats_counter counter)
+{
+    audio_stats_add(stats, dir, counter, 1);
+}
+
+#endif /* AUDIO_STATS_H */
@@ -0,0 +1,363 @@
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include "audio_buffer.h"
+#include "audio_stress.h"
+
+#define STRESS_MAX_PAIRS       16
+#define STRESS_MAX_DURATION_MS 60000
+
+// In-kernel stress benchmark. Producer kthreads copy fixed-size chunks into
+// the ring under write_mutex and consumer kthreads copy them out under
+// read_mutex, exactly as the file paths do but with no syscall or user copy
+// in the way, so the numbers isolate the ring and its locking. Each thread
+// times how long it waited for its side's mutex and how long it held it.
+//
+// The device must be idle in plain mode. config_rwsem is held shared for the
+// whole run so that no mode change, reset or resize can slip in, opening the
+// device fails with -EBUSY until it is over, and once the device is known to
+// be idle the ring is emptied before and after the run.
+
+struct stress_config {
+    unsigned int minor;
+    unsigned int pairs;
+    unsigned int chunk;
+    unsigned int duration_ms;
+};
+
+// Counters for one side, or for one thread while it runs
+struct stress_side {
+    u64 transfers;   // Lock sections that moved a chunk
+    u64 stalls;      // Lock sections that found the ring full or empty
+    u64 bytes;
+    u64 wait_ns;     // Time spent acquiring the mutex
+    u64 wait_max_ns;
+    u64 hold_ns;     // Time spent holding it
+    u64 hold_max_ns;
+};
+
+struct stress_thread {
+    struct audio_buffer_dev *dev;
+    struct task_struct *task;
+    size_t chunk;
+    void *data;
+    struct stress_side side;
+};
+
+struct stress_result {
+    bool valid;
+    struct stress_config config;
+    u64 elapsed_ns;
+    struct stress_side side[AUDIO_STATS_DIRS];
+};
+
+static DEFINE_MUTEX(stress_mutex);  // One run at a time; protects result
+static struct stress_result result;
+static struct proc_dir_entry *stress_entry;
+
+static const char * const side_names[AUDIO_STATS_DIRS] = { "Read", "Write" };
+
+static void stress_account(struct stress_side *side, u64 start, u64 locked, u64 unlocked)
+{
+    u64 wait = locked - start;
+    u64 hold = unlocked - locked;
+
+    side->wait_ns += wait;
+    side->hold_ns += hold;
+    side->wait_max_ns = max(side->wait_max_ns, wait);
+    side->hold_max_ns = max(side->hold_max_ns, hold);
+}
+
+static int stress_producer(void *arg)
+{
+    struct stress_thread *thread = arg;
+    struct audio_buffer_dev *dev = thread->dev;
+    u64 start, locked, unlocked;
+    unsigned long head;
+    bool moved;
+
+    while (!kthread_should_stop()) {
+        start = ktime_get_ns();
+        mutex_lock(&dev->write_mutex);
+        locked = ktime_get_ns();
+        moved = audio_buffer_make_room(dev, thread->chunk) >= thread->chunk;
+        if (moved) {
+            head = dev->head;
+            audio_ring_write(dev->buffer, dev->buffer_size, head, thread->data, thread->chunk);
+            audio_buffer_publish_write(dev, head, thread->chunk);
+        }
+        unlocked = ktime_get_ns();
+        mutex_unlock(&dev->write_mutex);
+
+        stress_account(&thread->side, start, locked, unlocked);
+        if (moved) {
+            thread->side.transfers++;
+            thread->side.bytes += thread->chunk;
+            audio_buffer_wake_readers(dev);
+        } else {
+            thread->side.stalls++;
+            cond_resched();
+        }
+    }
+    return 0;
+}
+
+static int stress_consumer(void *arg)
+{
+    struct stress_thread *thread = arg;
+    struct audio_buffer_dev *dev = thread->dev;
+    u64 start, locked, unlocked;
+    unsigned long tail;
+    size_t bytes;
+
+    while (!kthread_should_stop()) {
+        start = ktime_get_ns();
+        mutex_lock(&dev->read_mutex);
+        locked = ktime_get_ns();
+        bytes = min(thread->chunk, audio_ring_frames(audio_buffer_used(dev), FRAME_BYTES));
+        if (bytes) {
+            tail = dev->tail;
+            audio_ring_read(dev->buffer, dev->buffer_size, tail, thread->data, bytes);
+            audio_buffer_publish_tail(dev, tail + bytes);
+        }
+        unlocked = ktime_get_ns();
+        mutex_unlock(&dev->read_mutex);
+
+        stress_account(&thread->side, start, locked, unlocked);
+        if (bytes) {
+            thread->side.transfers++;
+            thread->side.bytes += bytes;
+            audio_buffer_wake_writers(dev);
+        } else {
+            thread->side.stalls++;
+            cond_resched();
+        }
+    }
+    return 0;
+}
+
+// Drop whatever is queued, with config_rwsem held on an idle device
+static void stress_drain(struct audio_buffer_dev *dev)
+{
+    mutex_lock(&dev->write_mutex);
+    mutex_lock(&dev->read_mutex);
+    audio_buffer_publish_tail(dev, dev->head);
+    mutex_unlock(&dev->read_mutex);
+    mutex_unlock(&dev->write_mutex);
+}
+
+static void stress_merge(struct stress_side *sum, const struct stress_side *side)
+{
+    sum->transfers += side->transfers;
+    sum->stalls += side->stalls;
+    sum->bytes += side->bytes;
+    sum->wait_ns += side->wait_ns;
+    sum->hold_ns += side->hold_ns;
+    sum->wait_max_ns = max(sum->wait_max_ns, side->wait_max_ns);
+    sum->hold_max_ns = max(sum->hold_max_ns, side->hold_max_ns);
+}
+
+// Producers are threads[0..pairs), consumers threads[pairs..2 * pairs)
+static int stress_run(const struct stress_config *config)
+{
+    unsigned int nr_threads = config->pairs * 2;
+    struct stress_thread *threads;
+    struct stress_thread *thread;
+    struct audio_buffer_dev *dev;
+    unsigned int i;
+    bool producer;
+    u64 start, elapsed = 0;
+    int ret = 0;
+
+    if (config->minor >= audio_buffer_device_count() || !config->pairs ||
+        config->pairs > STRESS_MAX_PAIRS || !config->chunk || config->chunk % FRAME_BYTES ||
+        !config->duration_ms || config->duration_ms > STRESS_MAX_DURATION_MS)
+        return -EINVAL;
+    dev = audio_buffer_get_device(config->minor);
+
+    threads = kcalloc(nr_threads, sizeof(*threads), GFP_KERNEL);
+    if (!threads)
+        return -ENOMEM;
+    ret = audio_buffer_get_ring(dev);
+    if (ret) {
+        kfree(threads);
+        return ret;
+    }
+
+    down_read(&dev->config_rwsem);
+    if (config->chunk > dev->buffer_size) {
+        ret = -EINVAL;
+        goto out_unlock;
+    }
+
+    // Nothing is touched until the device is known to be idle. Holding
+    // config_rwsem keeps out mode changes, clocks and in-kernel clients; no
+    // file may be opened until the run is over.
+    spin_lock(&dev->clients_lock);
+    if (READ_ONCE(dev->flags) || audio_buffer_consumer_busy(dev) ||
+        audio_buffer_producer_busy(dev) || !list_empty(&dev->clients))
+        ret = -EBUSY;
+    else
+        dev->clients_blocked = true;
+    spin_unlock(&dev->clients_lock);
+    if (ret)
+        goto out_unlock;
+    stress_drain(dev);
+
+    for (i = 0; i < nr_threads; i++) {
+        thread = &threads[i];
+        producer = i < config->pairs;
+        thread->dev = dev;
+        thread->chunk = config->chunk;
+        thread->data = kzalloc(config->chunk, GFP_KERNEL);
+        if (!thread->data) {
+            ret = -ENOMEM;
+            goto out_stop;
+        }
+        thread->task = kthread_create(producer ? stress_producer : stress_consumer, thread,
+                                      "audio_stress/%u:%c%u", config->minor,
+                                      producer ? 'w' : 'r', i % config->pairs);
+        if (IS_ERR(thread->task)) {
+            ret = PTR_ERR(thread->task);
+            thread->task = NULL;
+            goto out_stop;
+        }
+    }
+
+    start = ktime_get_ns();
+    for (i = 0; i < nr_threads; i++)
+        wake_up_process(threads[i].task);
+    // A signal cuts the run short; the results cover the time actually run
+    msleep_interruptible(config->duration_ms);
+    elapsed = ktime_get_ns() - start;
+
+out_stop:
+    for (i = 0; i < nr_threads; i++)
+        if (threads[i].task)
+            kthread_stop(threads[i].task);
+
+    if (!ret) {
+        memset(&result, 0, sizeof(result));
+        result.config = *config;
+        result.elapsed_ns = elapsed;
+        for (i = 0; i < nr_threads; i++)
+            stress_merge(&result.side[i < config->pairs ? AUDIO_STATS_WRITE : AUDIO_STATS_READ],
+                         &threads[i].side);
+        result.valid = true;
+    }
+    stress_drain(dev);
+    spin_lock(&dev->clients_lock);
+    dev->clients_blocked = false;
+    spin_unlock(&dev->clients_lock);
+
+out_unlock:
+    up_read(&dev->config_rwsem);
+    for (i = 0; i < nr_threads; i++)
+        kfree(threads[i].data);
+    kfree(threads);
+    audio_buffer_put_ring(dev);
+    return ret;
+}
+
+// Print value / count with three decimals, without floating point
+static void show_ratio(struct seq_file *m, const char *name, u64 value, u64 count)
+{
+    u64 milli = count ? div64_u64(value * 1000, count) : 0;
+
+    seq_printf(m, "%s: %llu.%03llu\n", name, milli / 1000, milli % 1000);
+}
+
+static int stress_show(struct seq_file *m, void *v)
+{
+    struct stress_side *side;
+    u64 sections;
+    char name[48];
+    int dir;
+
+    mutex_lock(&stress_mutex);
+    if (!result.valid) {
+        seq_printf(m, "No run yet; write \"minor pairs chunk_bytes duration_ms\" to start one\n");
+        goto out;
+    }
+
+    seq_printf(m, "Device: audio_buffer%u\n", result.config.minor);
+    seq_printf(m, "Pairs: %u\n", result.config.pairs);
+    seq_printf(m, "Chunk Size: %u bytes\n", result.config.chunk);
+    seq_printf(m, "Elapsed: %llu ns\n", result.elapsed_ns);
+    seq_printf(m, "Bytes Transferred: %llu\n", result.side[AUDIO_STATS_READ].bytes);
+    show_ratio(m, "Time per Byte (ns)", result.elapsed_ns, result.side[AUDIO_STATS_READ].bytes);
+
+    for (dir = 0; dir < AUDIO_STATS_DIRS; dir++) {
+        side = &result.side[dir];
+        sections = side->transfers + side->stalls;
+        seq_printf(m, "%s Transfers: %llu\n", side_names[dir], side->transfers);
+        seq_printf(m, "%s Stalls: %llu\n", side_names[dir], side->stalls);
+        snprintf(name, sizeof(name), "%s Lock Wait Avg (ns)", side_names[dir]);
+        show_ratio(m, name, side->wait_ns, sections);
+        seq_printf(m, "%s Lock Wait Max: %llu ns\n", side_names[dir], side->wait_max_ns);
+        snprintf(name, sizeof(name), "%s Lock Hold Avg (ns)", side_names[dir]);
+        show_ratio(m, name, side->hold_ns, sections);
+        seq_printf(m, "%s Lock Hold Max: %llu ns\n", side_names[dir], side->hold_max_ns);
+    }
+
+out:
+    mutex_unlock(&stress_mutex);
+    return 0;
+}
+
+static int stress_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stress_show, NULL);
+}
+
+// Runs the benchmark in the writing task and returns once it is over
+static ssize_t stress_write(struct file *file, const char __user *ubuf, size_t count,
+                            loff_t *ppos)
+{
+    struct stress_config config;
+    char buf[64];
+    int ret;
+
+    if (count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, ubuf, count))
+        return -EFAULT;
+    buf[count] = '\0';
+
+    if (sscanf(buf, "%u %u %u %u", &config.minor, &config.pairs, &config.chunk,
+               &config.duration_ms) != 4)
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&stress_mutex))
+        return -ERESTARTSYS;
+    ret = stress_run(&config);
+    mutex_unlock(&stress_mutex);
+
+    return ret ? ret : count;
+}
+
+static const struct proc_ops stress_fops = {
+    .proc_open    = stress_open,
+    .proc_read    = seq_read,
+    .proc_write   = stress_write,
+    .proc_lseek   = seq_lseek,
+    .proc_release = single_release,
+};
+
+void audio_stress_init(void)
+{
+    stress_entry = proc_create("audio_stress", 0600, NULL, &stress_fops);
+    if (!stress_entry)
+        printk(KERN_ERR "Audio Buffer: Failed to create /proc/audio_stress\n");
+}
+
+void audio_stress_cleanup(void)
+{
+    proc_remove(stress_entry);
+}
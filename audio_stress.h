@@ -0,0 +1,11 @@
+#ifndef AUDIO_STRESS_H
+#define AUDIO_STRESS_H
+
+// In-kernel stress benchmark, driven through /proc/audio_stress. Writing
+// "minor pairs chunk_bytes duration_ms" runs that many producer and consumer
+// kthreads against an idle device for the given time; reading the file
+// returns the results of the last run as "Key: value" lines.
+void audio_stress_init(void);
+void audio_stress_cleanup(void);
+
+#endif /* AUDIO_STRESS_H */
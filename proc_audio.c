@@ -3,33 +3,133 @@
 #include <linux/uaccess.h>
 #include <linux/timekeeping.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
 #include "proc_audio.h"
 #include "audio_buffer.h"
 
 extern struct audio_buffer_dev *audio_device;  // Use the existing audio buffer
 
+// The KUnit suite parses my_proc_show's output, so it is global whenever the
+// suite is built, standalone (make KUNIT_TEST=1) or from Kconfig
+#if IS_ENABLED(CONFIG_AUDIO_BUFFER_KUNIT_TEST)
+#define VISIBLE_IF_AUDIO_TEST
+#else
+#define VISIBLE_IF_AUDIO_TEST static
+#endif
+
 static struct proc_dir_entry *proc_entry;  // /proc file entry
 
-static unsigned int buffer_overruns = 0;  
-static unsigned int buffer_underruns = 0;  
+static const char * const dir_names[AUDIO_STATS_DIRS] = { "Read", "Write" };
+static const char * const hist_names[AUDIO_HISTS] = {
+    "Transfer Size (bytes)", "Wait Latency (ns)", "Fill Level (bytes)",
+};
+
+// Sum every CPU's statistics into sum. Each CPU's copy is read under its
+// seqcount, so the I/O path is never blocked and never seen half-updated.
+static void stats_snapshot(struct audio_buffer_dev *dev, struct audio_buffer_stats *sum,
+                           struct audio_buffer_stats *copy)
+{
+    struct audio_buffer_stats *s;
+    unsigned int seq;
+    int cpu, dir, hist, bucket, counter;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(dev->stats, cpu);
+        do {
+            seq = read_seqcount_begin(&s->seq);
+            memcpy(copy, s, sizeof(*copy));
+        } while (read_seqcount_retry(&s->seq, seq));
+
+        for (dir = 0; dir < AUDIO_STATS_DIRS; dir++) {
+            for (counter = 0; counter < AUDIO_STAT_COUNTERS; counter++)
+                sum->count[dir][counter] += copy->count[dir][counter];
+            for (hist = 0; hist < AUDIO_HISTS; hist++)
+                for (bucket = 0; bucket < AUDIO_STATS_BUCKETS; bucket++)
+                    sum->hist[dir][hist][bucket] += copy->hist[dir][hist][bucket];
+            sum->last_ns[dir] = max(sum->last_ns[dir], copy->last_ns[dir]);
+        }
+    }
+}
 
-static struct timespec64 last_write_time;
-static struct timespec64 last_read_time;
+// Print the non-empty buckets of one log2 histogram
+static void show_hist(struct seq_file *m, const char *dir, const char *name, const u64 *hist)
+{
+    int bucket;
+
+    seq_printf(m, "%s %s Histogram:\n", dir, name);
+    for (bucket = 0; bucket < AUDIO_STATS_BUCKETS; bucket++) {
+        if (!hist[bucket])
+            continue;
+        if (bucket == 0)
+            seq_printf(m, "  0: %llu\n", hist[bucket]);
+        else if (bucket == AUDIO_STATS_BUCKETS - 1)
+            seq_printf(m, "  %llu+: %llu\n", 1ULL << (bucket - 1), hist[bucket]);
+        else
+            seq_printf(m, "  %llu-%llu: %llu\n", 1ULL << (bucket - 1),
+                       (1ULL << bucket) - 1, hist[bucket]);
+    }
+}
 
 // Function to display content in /proc file
-static int my_proc_show(struct seq_file *m, void *v) {
-    mutex_lock(&audio_device->buffer_mutex);  // Lock the buffer while reading stats
+VISIBLE_IF_AUDIO_TEST int my_proc_show(struct seq_file *m, void *v) {
+    unsigned int count = audio_buffer_device_count();
+    struct audio_buffer_jitter_status jitter;
+    struct audio_buffer_stats *snap;
+    struct audio_buffer_dev *dev;
+    struct timespec64 ts;
+    unsigned int minor;
+    size_t resident = 0;
+    size_t used;
+    int dir, hist;
+
+    // Too big for the stack: the summed snapshot and a per-CPU scratch copy
+    snap = kmalloc_array(2, sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
 
     seq_printf(m, "Audio Buffer Module Stats:\n");
-    seq_printf(m, "Last Read Time: %lld.%09ld\n", last_read_time.tv_sec, last_read_time.tv_nsec);
-    seq_printf(m, "Last Write Time: %lld.%09ld\n", last_write_time.tv_sec, last_write_time.tv_nsec);
-    seq_printf(m, "Total Buffer Size: %zu bytes\n", audio_device->buffer_size);
-    seq_printf(m, "Current Buffer Usage: %zu bytes\n", audio_device->data_size);
-    seq_printf(m, "Available Buffer Space: %zu bytes\n", audio_device->buffer_size - audio_device->data_size);
-    seq_printf(m, "Buffer Overruns: %u\n", buffer_overruns);
-    seq_printf(m, "Buffer Underruns: %u\n", buffer_underruns);
+    seq_printf(m, "Stream Devices: %u\n", count);
+    for (minor = 0; minor < count; minor++)
+        resident += audio_buffer_resident(audio_buffer_get_device(minor));
+    seq_printf(m, "Resident Ring Memory: %zu bytes\n", resident);
+
+    for (minor = 0; minor < count; minor++) {
+        dev = audio_buffer_get_device(minor);
+        used = audio_buffer_used(dev);  // Lock-free snapshot of the fill level
+        stats_snapshot(dev, &snap[0], &snap[1]);
+
+        seq_printf(m, "\naudio_buffer%u:\n", minor);
+        seq_printf(m, "Total Buffer Size: %zu bytes\n", dev->buffer_size);
+        seq_printf(m, "Resident Buffer Memory: %zu bytes\n", audio_buffer_resident(dev));
+        seq_printf(m, "Current Buffer Usage: %zu bytes\n", used);
+        seq_printf(m, "Available Buffer Space: %zu bytes\n", dev->buffer_size - used);
+        seq_printf(m, "Buffer Overruns: %llu\n", snap->count[AUDIO_STATS_WRITE][AUDIO_STAT_XRUNS]);
+        seq_printf(m, "Buffer Underruns: %llu\n", snap->count[AUDIO_STATS_READ][AUDIO_STAT_XRUNS]);
+        seq_printf(m, "Dropped Frames: %llu\n", READ_ONCE(dev->dropped_frames));
+        seq_printf(m, "Mixer Inputs: %u\n", READ_ONCE(dev->mixer.nr_inputs));
+        seq_printf(m, "Mixer Underrun Frames: %llu\n", READ_ONCE(dev->mixer.underrun_frames));
+        audio_jitter_get_status(dev, &jitter);
+        seq_printf(m, "Jitter Buffer: %s\n", jitter.config.enable ? "on" : "off");
+        seq_printf(m, "Jitter Target: %llu bytes (%u us)\n", jitter.target_bytes, jitter.target_us);
+        seq_printf(m, "Write Jitter: %u us\n", jitter.jitter_us);
+        seq_printf(m, "Jitter Underruns: %llu\n", jitter.underruns);
+
+        for (dir = 0; dir < AUDIO_STATS_DIRS; dir++) {
+            ts = ns_to_timespec64(snap->last_ns[dir]);
+            seq_printf(m, "Last %s Time: %lld.%09ld\n", dir_names[dir], ts.tv_sec, ts.tv_nsec);
+            seq_printf(m, "%s Bytes: %llu\n", dir_names[dir], snap->count[dir][AUDIO_STAT_BYTES]);
+            seq_printf(m, "%s Calls: %llu\n", dir_names[dir], snap->count[dir][AUDIO_STAT_CALLS]);
+            seq_printf(m, "%s Blocked Waits: %llu\n", dir_names[dir], snap->count[dir][AUDIO_STAT_WAITS]);
+            seq_printf(m, "%s EAGAIN: %llu\n", dir_names[dir], snap->count[dir][AUDIO_STAT_EAGAIN]);
+        }
+
+        for (dir = 0; dir < AUDIO_STATS_DIRS; dir++)
+            for (hist = 0; hist < AUDIO_HISTS; hist++)
+                show_hist(m, dir_names[dir], hist_names[hist], snap->hist[dir][hist]);
+    }
     
-    mutex_unlock(&audio_device->buffer_mutex);  // Unlock after reading
+    kfree(snap);
     return 0;
 }
 
@@ -38,41 +138,6 @@ static int my_proc_open(struct inode *inode, struct file *file) {
     return single_open(file, my_proc_show, NULL);
 }
 
-// Function to write data to the audio buffer
-void write_to_buffer(char data) {
-    mutex_lock(&audio_device->buffer_mutex);  // Lock before modifying buffer
-
-    if (audio_device->data_size < audio_device->buffer_size) {
-        audio_device->buffer[audio_device->write_pos] = data;
-        audio_device->write_pos = (audio_device->write_pos + 1) % audio_device->buffer_size;
-        audio_device->data_size++;
-        ktime_get_real_ts64(&last_write_time);
-    } else {
-        buffer_overruns++;
-    }
-
-    mutex_unlock(&audio_device->buffer_mutex);  // Unlock after modification
-}
-
-// Function to read data from the audio buffer
-int read_from_buffer(void) {
-    char data;
-    mutex_lock(&audio_device->buffer_mutex);  // Lock before modifying buffer
-
-    if (audio_device->data_size > 0) {
-        data = audio_device->buffer[audio_device->read_pos];
-        audio_device->read_pos = (audio_device->read_pos + 1) % audio_device->buffer_size;
-        audio_device->data_size--;
-        ktime_get_real_ts64(&last_read_time);
-    } else {
-        buffer_underruns++;
-        data = -1;  // Indicate an empty buffer
-    }
-
-    mutex_unlock(&audio_device->buffer_mutex);  // Unlock after modification
-    return data;
-}
-
 // File operations for the proc file
 static const struct proc_ops my_proc_fops = {
     .proc_open    = my_proc_open,
@@ -1,7 +1,15 @@
 #ifndef PROC_AUDIO_H
 #define PROC_AUDIO_H
 
+#include <linux/kconfig.h>
+
 void proc_init(void);
 void proc_cleanup(void);
 
+#if IS_ENABLED(CONFIG_AUDIO_BUFFER_KUNIT_TEST)
+struct seq_file;
+// The /proc/my_stats contents, for the KUnit suite
+int my_proc_show(struct seq_file *m, void *v);
+#endif
+
 #endif /* PROC_AUDIO_H */
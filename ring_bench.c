@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "audio_ring.h"
+#include "audio_mix.h"
+#include "audio_convert.h"
+
+#define RING_SIZE (512 * 1024)   // The driver's default ring
+#define MIX_FRAMES 1024          // One mixer chunk
+#define MIX_CHANNELS 2
+#define MAX_INPUTS 8
+#define RUN_NS 200000000ULL      // Time spent on each case
+
+// Microbenchmarks for the header-only ring and mixing cores, built and run on
+// the host without loading the module. Each case repeats one operation for a
+// fixed time; the results are printed as CSV. On x86 the cost is measured in
+// TSC cycles (bytes_per_cycle), elsewhere only bytes_per_ns is meaningful.
+//
+//   ring_write/ring_read  copy size bytes into or out of the ring, stepping
+//                         the index so that copies regularly split at the wrap
+//   mix_N                 sum N inputs of one mixer chunk and clip the result;
+//                         bytes counts the input samples consumed
+//   convert_FMT_N         convert one mixer chunk of stream frames to N
+//                         channels of FMT, as a formatted read does; bytes
+//                         counts the stream bytes consumed
+
+static unsigned char *ring;
+static unsigned char *scratch;
+static s16 *inputs[MAX_INPUTS];
+static s32 acc[MIX_FRAMES * MIX_CHANNELS];
+static s16 out[MIX_FRAMES * MIX_CHANNELS];
+static u32 converted[MIX_FRAMES * AUDIO_BUFFER_MAX_CHANNELS];
+static volatile unsigned char sink;  // Keeps results observable
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void report(const char *test, size_t size, unsigned long long ops,
+                   unsigned long long bytes, unsigned long long ns, unsigned long long cyc)
+{
+    printf("%s,%zu,%llu,%.1f,%.3f,%.3f\n", test, size, ops, (double)ns / ops,
+           (double)bytes / ns, cyc ? (double)bytes / cyc : 0.0);
+}
+
+// The index advances by a little more than size each time, so over a run the
+// copies start at every alignment and cross the end of the ring
+static void bench_ring(const char *test, int write, size_t size)
+{
+    unsigned long long ops = 0, start, end, start_cyc;
+    unsigned long index = 0;
+    int i;
+
+    start = now_ns();
+    start_cyc = cycles();
+    do {
+        for (i = 0; i < 64; i++) {
+            if (write)
+                audio_ring_write(ring, RING_SIZE, index, scratch, size);
+            else
+                audio_ring_read(ring, RING_SIZE, index, scratch, size);
+            index += size + 4;
+        }
+        ops += 64;
+        end = now_ns();
+    } while (end - start < RUN_NS);
+
+    sink = scratch[0] ^ ring[0];
+    report(test, size, ops, ops * size, end - start, cycles() - start_cyc);
+}
+
+static void bench_mix(int nr_inputs, u32 gain)
+{
+    size_t samples = MIX_FRAMES * MIX_CHANNELS;
+    unsigned long long ops = 0, start, end, start_cyc;
+    char test[32];
+    int i;
+
+    start = now_ns();
+    start_cyc = cycles();
+    do {
+        audio_mix_first(acc, inputs[0], samples, gain);
+        for (i = 1; i < nr_inputs; i++)
+            audio_mix_add(acc, inputs[i], samples, gain);
+        audio_mix_clip(out, acc, samples);
+        ops++;
+        end = now_ns();
+    } while (end - start < RUN_NS);
+
+    sink = (unsigned char)out[0];
+    snprintf(test, sizeof(test), "mix_%d%s", nr_inputs, gain == AUDIO_MIX_UNITY ? "" : "_gain");
+    report(test, samples * sizeof(s16), ops, ops * nr_inputs * samples * sizeof(s16),
+           end - start, cycles() - start_cyc);
+}
+
+static void bench_convert(const char *name, u32 format, u32 channels)
+{
+    struct audio_buffer_format fmt = { .format = format, .channels = channels };
+    struct audio_convert conv;
+    unsigned long long ops = 0, start, end, start_cyc;
+    size_t bytes = MIX_FRAMES * MIX_CHANNELS * sizeof(s16);
+    char test[32];
+
+    if (audio_convert_setup(&conv, &fmt))
+        return;
+    start = now_ns();
+    start_cyc = cycles();
+    do {
+        audio_convert_frames(&conv, converted, inputs[0], MIX_FRAMES);
+        ops++;
+        end = now_ns();
+    } while (end - start < RUN_NS);
+
+    sink = (unsigned char)converted[0];
+    snprintf(test, sizeof(test), "convert_%s_%u", name, channels);
+    report(test, bytes, ops, ops * bytes, end - start, cycles() - start_cyc);
+}
+
+int main(void)
+{
+    static const size_t sizes[] = { 4, 64, 512, 4096, 32768 };
+    size_t i, j;
+
+    ring = calloc(1, RING_SIZE);
+    scratch = calloc(1, RING_SIZE);
+    if (!ring || !scratch)
+        return EXIT_FAILURE;
+    for (i = 0; i < MAX_INPUTS; i++) {
+        inputs[i] = malloc(MIX_FRAMES * MIX_CHANNELS * sizeof(s16));
+        if (!inputs[i])
+            return EXIT_FAILURE;
+        for (j = 0; j < MIX_FRAMES * MIX_CHANNELS; j++)
+            inputs[i][j] = (s16)(rand() - RAND_MAX / 2);
+    }
+
+    printf("test,size_bytes,ops,ns_per_op,bytes_per_ns,bytes_per_cycle\n");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        bench_ring("ring_write", 1, sizes[i]);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        bench_ring("ring_read", 0, sizes[i]);
+    for (i = 2; i <= MAX_INPUTS; i *= 2)
+        bench_mix(i, AUDIO_MIX_UNITY);
+    bench_mix(2, AUDIO_MIX_UNITY / 2);
+    bench_convert("s16", AUDIO_BUFFER_FORMAT_S16_LE, 1);
+    bench_convert("s32", AUDIO_BUFFER_FORMAT_S32_LE, 2);
+    bench_convert("float", AUDIO_BUFFER_FORMAT_FLOAT_LE, 2);
+    bench_convert("float", AUDIO_BUFFER_FORMAT_FLOAT_LE, 6);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "audio_ring.h"
+
+#define MAX_ORDER 12             // Rings of 1 byte up to 4 KB
+#define STANDALONE_RUNS 200000
+#define STANDALONE_INPUT 512
+
+// Differential fuzzer for the ring core. Each input is a script of writes,
+// reads, clears and resizes applied both to audio_ring.h and to a reference
+// model that moves one byte at a time with the same free-running indices, and
+// the two must agree on every byte read back and on the whole ring afterwards.
+// The first index comes from the input too, so the unsigned long wrap is
+// covered as well as the ring's.
+//
+// Built with clang -fsanitize=fuzzer (make ring_fuzz_libfuzzer) it is a
+// libFuzzer target; otherwise (make ring_fuzz) it runs random scripts from its
+// own generator: ./ring_fuzz [runs] [seed].
+
+struct input {
+    const unsigned char *data;
+    size_t len;
+};
+
+struct ring {
+    unsigned char *buf;
+    size_t size;
+};
+
+static unsigned int next_byte(struct input *in)
+{
+    if (!in->len)
+        return 0;
+    in->len--;
+    return *in->data++;
+}
+
+static unsigned long next_index(struct input *in)
+{
+    unsigned long index = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(index); i++)
+        index = index << 8 | next_byte(in);
+    return index;
+}
+
+#define check(cond, ...)                                                    \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "ring_fuzz: %s: ", #cond);                      \
+            fprintf(stderr, __VA_ARGS__);                                   \
+            fputc('\n', stderr);                                            \
+            abort();                                                        \
+        }                                                                   \
+    } while (0)
+
+static void ring_alloc(struct ring *ring, size_t size)
+{
+    ring->buf = calloc(1, size);
+    if (!ring->buf)
+        abort();
+    ring->size = size;
+}
+
+// The reference: byte i of the stream is slot i % size
+static void model_write(struct ring *model, unsigned long index, const unsigned char *src,
+                        size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        model->buf[(index + i) % model->size] = src[i];
+}
+
+static void model_read(const struct ring *model, unsigned long index, unsigned char *dst,
+                       size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        dst[i] = model->buf[(index + i) % model->size];
+}
+
+static void check_span(size_t size, unsigned long index, size_t len)
+{
+    struct audio_ring_span span = audio_ring_span(size, index, len);
+
+    check(span.pos == index % size, "size %zu index %lu", size, index);
+    check(span.first + span.second == len, "size %zu index %lu len %zu", size, index, len);
+    check(span.first <= size - span.pos, "size %zu index %lu len %zu", size, index, len);
+    check(!span.second || span.first == size - span.pos, "size %zu index %lu len %zu",
+          size, index, len);
+    check(span.second <= span.pos, "size %zu index %lu len %zu", size, index, len);
+}
+
+static void run(const unsigned char *data, size_t len)
+{
+    struct input in = { data, len };
+    struct ring ring, model, next_ring, next_model;
+    unsigned char src[1 << MAX_ORDER], got[1 << MAX_ORDER], want[1 << MAX_ORDER];
+    unsigned long head, tail;
+    size_t used, space, n, i;
+    unsigned int op;
+
+    ring_alloc(&ring, (size_t)1 << (next_byte(&in) % (MAX_ORDER + 1)));
+    ring_alloc(&model, ring.size);
+    head = tail = next_index(&in);
+
+    while (in.len) {
+        op = next_byte(&in);
+        used = audio_ring_used(head, tail);
+        space = audio_ring_space(ring.size, head, tail);
+        check(used + space == ring.size, "used %zu space %zu size %zu", used, space, ring.size);
+        n = (next_byte(&in) << 8 | next_byte(&in)) % (ring.size + 1);
+        check(audio_ring_frames(n, 4) % 4 == 0 && n - audio_ring_frames(n, 4) < 4, "n %zu", n);
+
+        switch (op % 4) {
+        case 0:  // Write up to the free space at head
+            n = n < space ? n : space;
+            for (i = 0; i < n; i++)
+                src[i] = (unsigned char)(op + i * 31 + head);
+            check_span(ring.size, head, n);
+            audio_ring_write(ring.buf, ring.size, head, src, n);
+            model_write(&model, head, src, n);
+            head += n;
+            break;
+        case 1:  // Read back up to what is queued at tail
+            n = n < used ? n : used;
+            check_span(ring.size, tail, n);
+            audio_ring_read(ring.buf, ring.size, tail, got, n);
+            model_read(&model, tail, want, n);
+            check(!memcmp(got, want, n), "read %zu at %lu from %zu", n, tail, ring.size);
+            tail += n;
+            break;
+        case 2:  // Zero a region at head, as a faulted MPSC reservation is
+            n = n < space ? n : space;
+            memset(src, 0, n);
+            audio_ring_clear(ring.buf, ring.size, head, n);
+            model_write(&model, head, src, n);
+            head += n;
+            break;
+        case 3:  // Move to a ring of another size that still holds the queue
+            ring_alloc(&next_ring, (size_t)1 << (next_byte(&in) % (MAX_ORDER + 1)));
+            if (next_ring.size < used) {
+                free(next_ring.buf);
+                break;
+            }
+            ring_alloc(&next_model, next_ring.size);
+            audio_ring_migrate(next_ring.buf, next_ring.size, ring.buf, ring.size, tail, used);
+            for (i = 0; i < used; i++)
+                next_model.buf[(tail + i) % next_model.size] = model.buf[(tail + i) % model.size];
+            free(ring.buf);
+            free(model.buf);
+            ring = next_ring;
+            model = next_model;
+            break;
+        }
+        check(!memcmp(ring.buf, model.buf, ring.size), "op %u len %zu head %lu tail %lu size %zu",
+              op % 4, n, head, tail, ring.size);
+    }
+
+    free(ring.buf);
+    free(model.buf);
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t len)
+{
+    run(data, len);
+    return 0;
+}
+
+#ifndef RING_FUZZ_LIBFUZZER
+// xorshift64, so a failing seed reproduces anywhere
+static unsigned long long next_random(unsigned long long *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long runs = argc > 1 ? strtoul(argv[1], NULL, 0) : STANDALONE_RUNS;
+    unsigned long long seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 1;
+    unsigned long long state = seed ? seed : 1;
+    unsigned char data[STANDALONE_INPUT];
+    unsigned long run_nr;
+    size_t len, i;
+
+    for (run_nr = 0; run_nr < runs; run_nr++) {
+        len = next_random(&state) % sizeof(data);
+        for (i = 0; i < len; i++)
+            data[i] = (unsigned char)next_random(&state);
+        // Every eighth run starts just short of the unsigned long wrap
+        if (run_nr % 8 == 0 && len > 1 + sizeof(unsigned long))
+            memset(data + 1, 0xff, sizeof(unsigned long) - 1);
+        run(data, len);
+    }
+    printf("ring_fuzz: %lu runs from seed %llu passed\n", runs, seed);
+    return EXIT_SUCCESS;
+}
+#endif
@@ -4,36 +4,74 @@
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <alsa/asoundlib.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include "audio_buffer_ioctl.h"
 
 #define BUFFER_SIZE 4096
-#define AUDIO_DEVICE "/dev/audio_buffer"
+#define AUDIO_DEVICE "/dev/audio_buffer0"
 #define ALSA_DEVICE "hw:Loopback,0"  // ALSA loopback device
 #define SAMPLE_RATE 44100
 #define CHANNELS 2
 #define FORMAT SND_PCM_FORMAT_S16_LE  // 16-bit samples
 
+// Map the driver's control page and ring into this process
+static int map_audio_buffer(int fd, struct audio_buffer_mmap_ctrl **ctrl, unsigned char **ring,
+                            size_t *ring_size, int prot)
+{
+    *ctrl = mmap(NULL, sizeof(**ctrl), PROT_READ, MAP_SHARED, fd, AUDIO_BUFFER_MMAP_CTRL_OFFSET);
+    if (*ctrl == MAP_FAILED) {
+        perror("Failed to map control page");
+        return -1;
+    }
+
+    *ring_size = (*ctrl)->buffer_size;
+    *ring = mmap(NULL, *ring_size, prot, MAP_SHARED, fd, AUDIO_BUFFER_MMAP_DATA_OFFSET);
+    if (*ring == MAP_FAILED) {
+        perror("Failed to map audio ring");
+        munmap(*ctrl, sizeof(**ctrl));
+        return -1;
+    }
+    return 0;
+}
+
+static void unmap_audio_buffer(struct audio_buffer_mmap_ctrl *ctrl, unsigned char *ring, size_t ring_size)
+{
+    munmap(ring, ring_size);
+    munmap(ctrl, sizeof(*ctrl));
+}
+
 // Thread function to read from our driver and write to the ALSA loopback
 void *playback_thread(void *arg)
 {
     int driver_fd;
     snd_pcm_t *pcm_handle;
-    char buffer[BUFFER_SIZE];
+    struct audio_buffer_mmap_ctrl *ctrl;
+    unsigned char *ring;
+    size_t ring_size;
     int ret;
     
-    // Open our audio buffer device
-    driver_fd = open(AUDIO_DEVICE, O_RDONLY);
+    // Open our audio buffer device (mapping it requires read access)
+    driver_fd = open(AUDIO_DEVICE, O_RDWR);
     if (driver_fd < 0) {
         perror("Failed to open audio buffer device");
         return NULL;
     }
+
+    if (map_audio_buffer(driver_fd, &ctrl, &ring, &ring_size, PROT_READ) < 0) {
+        close(driver_fd);
+        return NULL;
+    }
     
     // Open the ALSA loopback device for playback
     ret = snd_pcm_open(&pcm_handle, ALSA_DEVICE, SND_PCM_STREAM_PLAYBACK, 0);
     if (ret < 0) {
         fprintf(stderr, "Cannot open ALSA device: %s\n", snd_strerror(ret));
+        unmap_audio_buffer(ctrl, ring, ring_size);
         close(driver_fd);
         return NULL;
     }
@@ -58,23 +96,28 @@ void *playback_thread(void *arg)
     
     snd_pcm_hw_params(pcm_handle, hw_params);
     
-    // Calculate frames per buffer
-    int frames = BUFFER_SIZE / (CHANNELS * snd_pcm_format_width(FORMAT) / 8);
+    // Calculate bytes per frame
+    size_t frame_bytes = CHANNELS * snd_pcm_format_width(FORMAT) / 8;
     
     printf("Playback thread started. Reading from driver and playing to ALSA loopback.\n");
     
     while (1) {
-        // Read from our device driver
-        ssize_t bytes_read = read(driver_fd, buffer, BUFFER_SIZE);
+        // Play straight out of the mapped ring, up to the wrap point
+        uint64_t tail = __atomic_load_n(&ctrl->tail, __ATOMIC_RELAXED);
+        size_t queued = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE) - tail;
+        size_t read_pos = tail % ring_size;
+        size_t contiguous = ring_size - read_pos;
+        int frames_read = (queued < contiguous ? queued : contiguous) / frame_bytes;
 
-        if (bytes_read <= 0) {
-            // No data available, wait a bit
-            usleep(100000);  // 100ms
+        if (frames_read == 0) {
+            // No data available, sleep until the driver reports some
+            struct pollfd pfd = { .fd = driver_fd, .events = POLLIN };
+            if (poll(&pfd, 1, -1) < 0)
+                perror("Poll error");
             continue;
         }
 
-        // Calculate number of frames read
-        int frames_read = bytes_read / (CHANNELS * snd_pcm_format_width(FORMAT) / 8);
+        unsigned char *buffer = ring + read_pos;
 
         // Write to ALSA loopback
         ret = snd_pcm_writei(pcm_handle, buffer, frames_read);
@@ -97,13 +140,20 @@ void *playback_thread(void *arg)
                     snd_pcm_prepare(pcm_handle);
                 }
             }
-        } else {
+        }
+
+        if (ret > 0) {
+            // Hand the played frames back to the producer
+            size_t consumed = ret * frame_bytes;
+            if (ioctl(driver_fd, AUDIO_BUFFER_IOCTL_COMMIT_READ, &consumed) < 0)
+                perror("Commit read error");
             printf("Played %d frames\n", ret);
         }
     }
     
     // Cleanup
     snd_pcm_close(pcm_handle);
+    unmap_audio_buffer(ctrl, ring, ring_size);
     close(driver_fd);
     return NULL;
 }
@@ -113,21 +163,22 @@ void *generator_thread(void *arg)
 {
     int driver_fd;
     int16_t *buffer;
-    int buffer_size = BUFFER_SIZE;
-    int sample_count = buffer_size / sizeof(int16_t);
+    struct audio_buffer_mmap_ctrl *ctrl;
+    unsigned char *ring;
+    size_t ring_size;
+    size_t frame_bytes = CHANNELS * sizeof(int16_t);
+    int sample_count;
     int i;
     
-    // Open our audio buffer device
-    driver_fd = open(AUDIO_DEVICE, O_WRONLY);
+    // Open our audio buffer device (mapping it requires read access)
+    driver_fd = open(AUDIO_DEVICE, O_RDWR);
     if (driver_fd < 0) {
         perror("Failed to open audio buffer device");
         return NULL;
     }
     
-    // Allocate buffer
-    buffer = (int16_t *)malloc(buffer_size);
-    if (!buffer) {
-        perror("Failed to allocate memory");
+    // Map the ring so samples are generated in place
+    if (map_audio_buffer(driver_fd, &ctrl, &ring, &ring_size, PROT_READ | PROT_WRITE) < 0) {
         close(driver_fd);
         return NULL;
     }
@@ -140,6 +191,25 @@ void *generator_thread(void *arg)
     double phase_increment = 2.0 * M_PI * frequency / SAMPLE_RATE;
     
     while (1) {
+        // Fill the free part of the ring up to the wrap point
+        uint64_t head = __atomic_load_n(&ctrl->head, __ATOMIC_RELAXED);
+        size_t queued = head - __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+        size_t write_pos = head % ring_size;
+        size_t contiguous = ring_size - write_pos;
+        size_t space = ring_size - queued;
+        size_t bytes = (space < contiguous ? space : contiguous) / frame_bytes * frame_bytes;
+
+        if (bytes == 0) {
+            // Ring is full, sleep until the consumer frees some space
+            struct pollfd pfd = { .fd = driver_fd, .events = POLLOUT };
+            if (poll(&pfd, 1, -1) < 0)
+                perror("Poll error");
+            continue;
+        }
+
+        buffer = (int16_t *)(ring + write_pos);
+        sample_count = bytes / sizeof(int16_t);
+
         // Generate sine wave
         for (i = 0; i < sample_count; i += CHANNELS) {
             // Sine wave for left channel
@@ -155,21 +225,20 @@ void *generator_thread(void *arg)
                 phase -= 2.0 * M_PI;
         }
         
-        // Write to our device driver
-        ssize_t bytes_written = write(driver_fd, buffer, buffer_size);
-        if (bytes_written < 0) {
-            perror("Write error");
+        // Publish the generated samples to the driver
+        if (ioctl(driver_fd, AUDIO_BUFFER_IOCTL_COMMIT_WRITE, &bytes) < 0) {
+            perror("Commit write error");
             break;
         }
         
-        printf("Generated and wrote %zd bytes of audio data\n", bytes_written);
+        printf("Generated and committed %zu bytes of audio data\n", bytes);
         
         // Sleep a bit to avoid overwhelming the buffer
         usleep(10000);  // 10ms
     }
     
     // Cleanup
-    free(buffer);
+    unmap_audio_buffer(ctrl, ring, ring_size);
     close(driver_fd);
     return NULL;
 }